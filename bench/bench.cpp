@@ -0,0 +1,1122 @@
+//
+//  bench.cpp
+//
+//  Headless host benchmark for the MPEG decoder.
+//  Drives MpegDecoder::run() from the embedded clips or file:// urls, video and audio
+//  go to no-op sinks so the numbers are pure decode time.
+//
+//  g++ -O2 -DMPEG_PROFILE -I../src bench.cpp ../src/player.cpp ../src/streamer.cpp ../src/sbc_decoder.cpp -lpthread -o bench
+//  ./bench [-n loops] [-j threads] [-J threads] [-p] [-a] [-y] [-s simd] [-d fps] [-b strips] [-r] [-k bits] [-t scale] [-f step] [-e step] [-w|-c sums.txt] [-o out.y4m] [-m stats.txt] [splash] [vmedia] [synth] [synth_b] [file:///path/video.ts]
+//
+//  -j decodes slices in parallel, -p reconstructs macroblocks on a second thread,
+//  -J runs the clips with 1 to n slice workers and prints each count's decode time against one.
+//  -a shares fully skipped strips between the frames instead of copying them.
+//  -y decodes luma only.
+//  -s limits host SIMD kernels to 0 scalar, 1 sse2 or 2 avx2, the best available is the default.
+//  -d presents frames against a fps deadline so the decoder degrades when it falls behind.
+//  B pictures are drawn into a ring of MPEG_JIT_STRIPS strips just ahead of a virtual NTSC beam and
+//  their checksums are of what the beam scanned. The beam only moves when the decoder waits for it, as if
+//  decoding took no time, so runs don't depend on the host and a late picture or strip is a scheduling bug
+//  that fails the run.
+//  -b also shows the other pictures on their pts against the beam, with a ring of n strips.
+//  -r with -b releases the strips of the frame being replaced as the beam scans them for the last time,
+//  the decoder draws the next picture into them instead of waiting for the flip. What the beam scanned of
+//  each replaced frame is checked against the frame as it was pushed.
+//
+//  -t reconstructs at 1/4 or 1/8 scale as trick play does, blocks keep their DC and first AC coefficients
+//  and are replicated back to full size. Compare the pictures against a full decode with -o and yuvcmp.
+//
+//  -f plays the clip as I picture trick play does. Its I pictures are found as the indexer finds them and
+//  every step-th one, backwards when negative, is fed to the decoder as a range of its own and shown at the
+//  trick cadence. Each is checked against the same picture of a plain decode of the clip.
+//
+//  -e seeks to every step-th picture of the clip. Decoding starts at the last random access point at or
+//  before it, as video.idx maps it, and the pictures in between are decoded but not shown. The time to the
+//  first picture shown is measured and the picture is checked against the plain decode.
+//
+//  -k packs the reference frames at 2 or 3 bits a pixel. Each clip is decoded plain first, then packed,
+//  and the memory saved, the decode time against plain and the luma PSNR against the plain pictures by
+//  pictures since the last I picture are printed, prediction from packed references drifts.
+//  Checksums and y4m are of the packed run. Not in builds with -DMPEG_PACKED_FRAMES=0.
+//
+//  -w writes a checksum of every picture and of the decoded SBC pcm of each clip, -c checks
+//  a run against them and exits with 1 on any difference. Checksums are taken on every loop,
+//  hashing time is left out of the decode time. golden.txt has the embedded and synthetic clips:
+//  ./bench -c golden.txt
+//
+//  synth and synth_b are generated by synth.h to cover the syntax the embedded clips don't use, synth_b
+//  has the B pictures. The frames are erased before each clip, pictures smaller than the frame leave the
+//  rest of it alone.
+//
+//  -o writes the pictures of the first clip as planar 4:2:0 y4m, compare them with yuvcmp.
+//
+//  -m writes macroblock statistics of every picture and histograms of each clip, and prints
+//  a summary per clip. Needs -DMPEG_STATS.
+//
+//  Drop -DMPEG_PROFILE for frames/second without the cost of the per stage counters.
+//  -DFB_WIDTH=320 -DFB_HEIGHT=240 builds another frame size, golden.txt is for the default 352x192.
+//  -fsanitize=undefined runs clean with every option, keep it that way.
+//
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "unistd.h"
+#include "sys/wait.h"
+#include "math.h"
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+using namespace std;
+
+#include "player.h"
+#include "streamer.h"
+#include "splash.h"
+#include "vmedia.h"
+#include "synth.h"
+
+//====================================================================================
+//====================================================================================
+// Sinks for the decoder
+
+typedef struct {
+    int frames;
+    int audio_bytes;
+    uint64_t picture_ticks;
+    uint64_t predict_ticks;
+    uint64_t block_ticks;
+    uint64_t idct_ticks;
+    uint64_t vlc_ticks;
+    uint64_t render_ticks;
+    uint64_t release_ticks;     // blocked on the beam, not in picture_ticks
+    uint64_t hash_us;   // checksums and y4m, not decode time
+    int late;           // pictures shown late against the beam
+    int late_strips;    // of B pictures
+    int waits;          // rows the decoder waited for the beam to release
+} bench_stats;
+
+bench_stats _stats;
+int _deadline_fps = 0;
+uint64_t _clip_start;
+
+static uint64_t now_us();
+
+//====================================================================================
+//====================================================================================
+// Checksums of decoded output
+
+bool _sums = false;
+vector<string> _frame_sums;     // "index hash pts" of each picture of the clip
+vector<uint8_t> _sbc;           // sbc of the clip, decoded when the clip is done
+
+static uint64_t fnv(uint64_t h, const uint8_t* d, int len)
+{
+    while (len--)
+        h = (h ^ *d++) * 1099511628211ULL;
+    return h;
+}
+
+// of the top left width x height, a picture smaller than the frame leaves the rest of it alone
+static uint64_t frame_hash(Frame* f, int width = FB_WIDTH, int height = FB_HEIGHT)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (int y = 0; y < height; y++)
+        h = fnv(h,f->get_y(y),width);
+    for (int y = 0; y < height/2; y++) {
+        h = fnv(h,f->get_cr(y),width/2);
+        h = fnv(h,f->get_cb(y),width/2);
+    }
+    return h;
+}
+
+static int pct(uint64_t n, uint64_t d)
+{
+    return d ? (int)(n*100/d) : 0;
+}
+
+// Macroblock statistics, of the first loop
+MpegDecoder* _decoder = 0;
+bool _first_loop;
+FILE* _mb_out = 0;
+MBStats _clip_mb;
+
+static int blocks(const MBStats& s, int from = 1, int to = 64)
+{
+    int n = 0;
+    for (int i = from; i <= to; i++)
+        n += s.coeffs[i];
+    return n;
+}
+
+static int coeffs(const MBStats& s)
+{
+    int n = 0;
+    for (int i = 1; i <= 64; i++)
+        n += s.coeffs[i]*i;
+    return n;
+}
+
+// h and v motion vector ranges, - if there were none
+static string mv_range(const MBStats& s)
+{
+    if (s.mv_min[0] > s.mv_max[0])
+        return "-";
+    char r[64];
+    snprintf(r,sizeof(r),"%d..%d,%d..%d",s.mv_min[0],s.mv_max[0],s.mv_min[1],s.mv_max[1]);
+    return r;
+}
+
+static void write_mb_stats(int index)
+{
+    const MBStats& s = _decoder->stats();
+    int q0 = 31, q1 = 0;
+    for (int i = 1; i < 32; i++)
+        if (s.quant[i]) {
+            q0 = min(q0,i);
+            q1 = max(q1,i);
+        }
+    fprintf(_mb_out,"%d %c intra:%d inter:%d skip:%d blocks:%d coeffs:%d mv:%s half:%d/%d/%d/%d q:%d..%d\n",
+        index," IPBD"[s.type & 3],s.intra,s.inter,s.skipped,blocks(s),coeffs(s),mv_range(s).c_str(),
+        s.half_pel[0],s.half_pel[1],s.half_pel[2],s.half_pel[3],q1 ? q0 : 0,q1);
+    add_stats(_clip_mb,s);
+}
+
+static void hist(const char* name, const uint32_t* h, int n)
+{
+    fprintf(_mb_out,"%s",name);
+    for (int i = 0; i < n; i++)
+        fprintf(_mb_out," %d",h[i]);
+    fprintf(_mb_out,"\n");
+}
+
+static void mb_summary(const char* name)
+{
+    const MBStats& s = _clip_mb;
+    fprintf(_mb_out,"%s\n",name);
+    hist("cbp",s.cbp,64);
+    hist("coeffs",s.coeffs,65);
+    hist("quant",s.quant,32);
+    hist("half_pel",s.half_pel,4);
+
+    int mbs = s.intra + s.inter + s.skipped;
+    int inter = max(1,(int)s.inter);
+    int b = max(1,blocks(s));
+    printf("%s: mbs intra:%d%% inter:%d%% skip:%d%% blocks/mb:%d.%02d coeffs/block:%d.%02d\n",name,
+        pct(s.intra,mbs),pct(s.inter,mbs),pct(s.skipped,mbs),blocks(s)/max(1,mbs - (int)s.skipped),
+        blocks(s)*100/max(1,mbs - (int)s.skipped)%100,coeffs(s)/b,coeffs(s)*100/b%100);
+    printf("%s: blocks of 1:%d%% 2-4:%d%% 5-16:%d%% 17+:%d%% half pel inter h:%d%% v:%d%% hv:%d%% mv:%s\n",name,
+        pct(blocks(s,1,1),b),pct(blocks(s,2,4),b),pct(blocks(s,5,16),b),pct(blocks(s,17,64),b),
+        pct(s.half_pel[1],inter),pct(s.half_pel[2],inter),pct(s.half_pel[3],inter),mv_range(s).c_str());
+}
+
+// Frame strips are YYYYUU/YYYYVV, y4m wants planar Y then Cb then Cr
+FILE* _y4m = 0;
+static void write_y4m(Frame* f)
+{
+    if (ftell(_y4m) == 0)
+        fprintf(_y4m,"YUV4MPEG2 W%d H%d F30000:1001 Ip A1:1 C420jpeg\n",FB_WIDTH,FB_HEIGHT);
+    fprintf(_y4m,"FRAME\n");
+    for (int y = 0; y < FB_HEIGHT; y++)
+        fwrite(f->get_y(y),1,FB_WIDTH,_y4m);
+    for (int y = 0; y < FB_HEIGHT/2; y++)
+        fwrite(f->get_cb(y),1,FB_WIDTH/2,_y4m);
+    for (int y = 0; y < FB_HEIGHT/2; y++)
+        fwrite(f->get_cr(y),1,FB_WIDTH/2,_y4m);
+}
+
+//====================================================================================
+//====================================================================================
+// -k compares packed reference frames with a plain run of the same clip
+
+#define DRIFT_PICTURES 32
+
+int _packed_bits = 0;
+bool _plain_pass = false;
+vector<vector<uint8_t> > _plain_y;  // luma of each picture of the plain run
+Frame _unpacked;
+int _since_i;
+double _drift_psnr[DRIFT_PICTURES];
+int _drift_count[DRIFT_PICTURES];
+uint64_t _last_elapsed;         // of the last bench()
+int _last_frames;
+
+static void drift(Frame* f, int index)
+{
+    if (_decoder->picture_type() == MpegDecoder::I_FRAME)
+        _since_i = 0;
+    int k = min(_since_i++,DRIFT_PICTURES-1);
+    if (index >= (int)_plain_y.size())
+        return;
+    uint64_t sse = 0;
+    const uint8_t* p = &_plain_y[index][0];
+    for (int y = 0; y < FB_HEIGHT; y++) {
+        const uint8_t* s = f->get_y(y);
+        for (int x = 0; x < FB_WIDTH; x++) {
+            int d = s[x] - *p++;
+            sse += d*d;
+        }
+    }
+    _drift_psnr[k] += sse ? 10*log10(255.0*255.0*FB_WIDTH*FB_HEIGHT/sse) : 99.99;
+    _drift_count[k]++;
+}
+
+// same framing as decode_audio in video.cpp
+static string pcm_sum()
+{
+    SBC_Decode sbc;
+    sbc_init(&sbc);
+    uint64_t h = 1469598103934665603ULL;
+    int samples = 0;
+    int16_t pcm[128];
+    int frame_size = 0;
+    if (_sbc.size() >= 64)
+        frame_size = sbc_decoder(&sbc,&_sbc[0],64,pcm,sizeof(pcm),0);
+    for (size_t i = 0; frame_size && i + frame_size <= _sbc.size(); i += frame_size) {
+        sbc_decoder(&sbc,&_sbc[i],frame_size,pcm,sizeof(pcm),0);
+        h = fnv(h,(const uint8_t*)pcm,sizeof(pcm));
+        samples += 128;
+    }
+    char s[64];
+    snprintf(s,sizeof(s),"pcm %016llx %d",(unsigned long long)h,samples);
+    return s;
+}
+
+//====================================================================================
+//====================================================================================
+// -f feeds the I pictures of a clip a range at a time, as trick play fetches them from video.ts
+// -e seeks from the random access points of the clip
+
+#define TRICK_INTERVAL (90000/6)        // as ESPFLIX_TRICK_INTERVAL
+
+int _trick_step = 0;
+const uint8_t* _trick_clip;
+vector<uint8_t> _clip;                  // file clips, ranges are served from memory
+typedef struct {
+    uint32_t first;     // packet
+    uint32_t packets;
+    int64_t pts;
+    int width;          // of its sequence, within the frame
+    int height;
+} IRange;
+vector<IRange> _iframes;                // of each I picture
+map<int64_t,uint64_t> _plain_hashes;    // pictures of the plain run by pts
+vector<int64_t> _plain_pts;             // in display order
+int _seek_step = 0;
+uint64_t _seek_start;
+int64_t _seek_shown;                    // pts of the first picture shown, -1 until then
+uint64_t _seek_us;
+uint64_t _seek_hash;
+int _trick_next;                        // next range
+uint64_t _trick_bytes;
+int _trick_bad;
+
+// as the indexer finds them, a sequence header up to the next video PES
+static void find_iframes(const uint8_t* d, int len)
+{
+    _iframes.clear();
+    int open = -1;
+    int64_t pts = -1;
+    int width = FB_WIDTH, height = FB_HEIGHT;
+    for (int p = 0; (p+1)*188 <= len; p++) {
+        const uint8_t* t = d + p*188;
+        int pid = ((t[1] << 8) + t[2]) & 0x1fff;
+        if (pid != 0x100 || !(t[1] & 0x40) || !(t[3] & 0x10))
+            continue;
+        const uint8_t* pes = t + 4;
+        if (t[3] & 0x20)
+            pes = t + 5 + t[4];
+        if (open != -1)
+            _iframes.push_back({(uint32_t)open,(uint32_t)(p - open),pts,width,height});
+        const uint8_t* q = pes + 9 + pes[8];
+        open = q[3] == 0xB3 ? p : -1;
+        if (open != -1) {
+            width = min((q[4] << 4) | (q[5] >> 4),FB_WIDTH);
+            height = min(((q[5] & 0x0F) << 8) | q[6],FB_HEIGHT);
+        }
+        const uint8_t* s = pes + 9;
+        if (pes[7] & 0x80)
+            pts = ((int64_t)(s[0] & 0x0E) << 29) + ((((s[1] << 8) | s[2]) >> 1) << 15) + ((((s[3] << 8) | s[4]) >> 1));
+    }
+    if (open != -1)
+        _iframes.push_back({(uint32_t)open,(uint32_t)(len/188 - open),pts,width,height});
+}
+
+// trick play shows the I pictures of sequences of any size in any order, only the picture is compared
+static uint64_t picture_hash(Frame* f, int64_t pts)
+{
+    for (auto& r : _iframes)
+        if (r.pts == pts)
+            return frame_hash(f,r.width,r.height);
+    return frame_hash(f);
+}
+
+static const uint8_t* clip_data(const char* name, int& len)
+{
+    if (strcmp(name,"splash") == 0) {
+        len = sizeof(splash_ts);
+        return splash_ts;
+    }
+    if (strcmp(name,"vmedia") == 0) {
+        len = sizeof(vmedia);
+        return vmedia;
+    }
+    if (const uint8_t* d = synth_clip(name,len))
+        return d;
+    FILE* f = strncmp(name,"file://",7) ? 0 : fopen(name+7,"rb");
+    if (!f)
+        return 0;
+    fseek(f,0,SEEK_END);
+    _clip.resize(ftell(f));
+    fseek(f,0,SEEK_SET);
+    len = (int)fread(_clip.data(),1,_clip.size(),f);
+    fclose(f);
+    return _clip.data();
+}
+
+// same as ESPFlix::decode_next in trick play, the next range is fetched when one runs dry
+static int trick_next(MpegDecoder& decoder, Streamer& streamer)
+{
+    Buffer* b = decoder.pop_empty();
+    if (!b)
+        return -1;
+    int n = (int)streamer.read(b->data,(int)sizeof(b->data));
+    if (n == 0 && _trick_next >= 0 && _trick_next < (int)_iframes.size()) {
+        auto& r = _iframes[_trick_next];
+        _trick_next += _trick_step;
+        _trick_bytes += r.packets*188;
+        streamer.get_rom(_trick_clip + r.first*188,r.packets*188);
+        n = (int)streamer.read(b->data,(int)sizeof(b->data));
+    }
+    b->len = n;
+    decoder.push_full(b);
+    return n;
+}
+
+//====================================================================================
+//====================================================================================
+// A virtual NTSC beam. B pictures are drawn a strip at a time just ahead of it and the first field the
+// beam scanned is what is checked, with -b the other pictures are shown on their pts.
+// It is a clock of lines that only moves forward when the decoder waits for it.
+
+Frame* _frames;                 // erased before each clip
+int _beam = 0;                  // -b ring strips, 0 shows pictures as they are decoded
+int64_t _beam_now;              // lines since the clip started
+std::mutex _beam_lock;          // slice workers wait for early released strips too
+int64_t _beam_pts = -1;         // pts field shown at _beam_field
+int _beam_field;
+Frame* _jit_frame = 0;
+int64_t _jit_pts;
+int _jit_first;                 // strip the B picture is first scanned from
+int _jit_scanned;               // strips of its first field captured
+Frame _scanned;                 // what the beam saw
+Frame* _rel_frame = 0;          // being released
+int _rel_first;                 // strip the release starts at
+int _rel_scanned;
+uint64_t _rel_hash;             // as it was when it was replaced
+Frame _rel_copy;                // what the beam saw of it
+int _rel_bad = 0;
+
+#define BEAM_LINES 262          // a field, the frame letterboxed in the middle 240
+#define BEAM_TOP (8 + (VIDEO_NTSC_LINES - FB_HEIGHT)/2)
+
+static int beam_line()
+{
+    std::lock_guard<std::mutex> lock(_beam_lock);
+    return (int)_beam_now;
+}
+
+static void beam_move(int64_t line)
+{
+    std::lock_guard<std::mutex> lock(_beam_lock);
+    _beam_now = max(_beam_now,line);
+}
+
+static void beam_wait(int field)
+{
+    beam_move((int64_t)field*BEAM_LINES);
+}
+
+// field pts is shown in, the first picture gets a couple of fields of slack
+static int beam_due(int64_t pts)
+{
+    if (_beam_pts == -1) {
+        _beam_pts = pts/1500;
+        _beam_field = beam_line()/BEAM_LINES + 2;
+    }
+    return (int)(pts/1500 - _beam_pts) + _beam_field;
+}
+
+static void show(Frame* f, int64_t pts)
+{
+    _stats.frames++;
+#if MPEG_PACKED_FRAMES
+    if (f->_packed) {
+        uint64_t t = now_us();
+        for (int i = 0; i < FB_SLICES; i++)
+            f->unpack_strip(i,_unpacked._slices[i]);
+        f = &_unpacked;
+        _stats.hash_us += now_us() - t;
+    }
+#endif
+#ifdef MPEG_PROFILE
+    _stats.picture_ticks += _picture_ticks;
+    _stats.predict_ticks += _predict_ticks;
+    _stats.block_ticks += _block_ticks;
+    _stats.idct_ticks += _idct_ticks;
+    _stats.vlc_ticks += _vlc_ticks;
+    _stats.render_ticks += _render_ticks;
+    _stats.release_ticks += _release_ticks;
+    _picture_ticks = _block_ticks = _predict_ticks = _idct_ticks = _vlc_ticks = _render_ticks = _release_ticks = 0;
+#endif
+    if (_plain_pass) {
+        if (_trick_step || _seek_step) {
+            _plain_hashes[pts] = picture_hash(f,pts);
+            _plain_pts.push_back(pts);
+        } else if (_first_loop) {
+            vector<uint8_t> y;
+            for (int i = 0; i < FB_HEIGHT; i++)
+                y.insert(y.end(),f->get_y(i),f->get_y(i) + FB_WIDTH);
+            _plain_y.push_back(y);
+        }
+        return;
+    }
+    if (_packed_bits && _first_loop) {
+        uint64_t t = now_us();
+        drift(f,_stats.frames-1);
+        _stats.hash_us += now_us() - t;
+    }
+    if (_seek_step && _seek_shown == -1) {
+        _seek_us = now_us() - _seek_start;
+        _seek_hash = picture_hash(f,pts);
+        _seek_shown = pts;
+    }
+    if (_trick_step) {
+        uint64_t t = now_us();
+        auto h = _plain_hashes.find(_decoder->get_pts());
+        if (h == _plain_hashes.end() || h->second != picture_hash(f,h->first))
+            _trick_bad++;
+        _stats.hash_us += now_us() - t;
+    }
+    if (_mb_out && _first_loop)
+        write_mb_stats(_stats.frames-1);
+    if (_y4m) {
+        uint64_t t = now_us();
+        write_y4m(f);
+        _stats.hash_us += now_us() - t;
+    }
+    if (_sums) {
+        uint64_t t = now_us();
+        char s[64];
+        snprintf(s,sizeof(s),"%d %016llx %lld",_stats.frames-1,(unsigned long long)frame_hash(f),(long long)pts);
+        _frame_sums.push_back(s);
+        _stats.hash_us += now_us() - t;
+    }
+}
+
+// the frame being replaced is scanned for the last time in field last
+static void release_start(Frame* f, int last)
+{
+    _rel_frame = f;
+    _rel_first = _rel_scanned = last*FB_SLICES;
+    if (!f->_packed)
+        _rel_hash = frame_hash(f);
+}
+
+void video_shown()
+{
+    if (!_rel_frame)
+        return;
+    beam_wait(_rel_first/FB_SLICES + 1);
+    while (_rel_scanned < _rel_first + FB_SLICES)
+        video_strip();
+    if (!_rel_frame->_packed && frame_hash(&_rel_copy) != _rel_hash) {
+        printf("strips released early were drawn into before the beam left them\n");
+        _rel_bad++;
+    }
+    _rel_frame = 0;
+}
+
+int push_video(Frame* f, int front, int64_t pts, int, int* released)
+{
+    if (_beam) {
+        video_shown();
+        int d = beam_due(pts);
+        if (released) {
+            int now = beam_line()/BEAM_LINES;
+            int last = max(d - 1,now);
+            release_start(f + (front ^ 1),last);
+            beam_wait(last);
+            *released = last*FB_SLICES;
+            show(f + front,pts);
+            _stats.late += now >= d;
+            return now >= d ? now - d + 1 : 0;
+        }
+        beam_wait(d);
+        show(f + front,pts);
+        int late = beam_line()/BEAM_LINES - d;
+        _stats.late += late > 0;
+        return late > 0 ? late : 0;
+    }
+    show(f + front,pts);
+    if (!_deadline_fps)
+        return 0;
+    int64_t due = _stats.frames*1000000LL/_deadline_fps;   // frames late against the deadline
+    int64_t late = ((int64_t)(now_us() - _clip_start) - due)*_deadline_fps/1000000;
+    return late > 0 ? (int)late : 0;
+}
+
+void push_audio(const uint8_t* data, int len, int64_t, bool)
+{
+    _stats.audio_bytes += len;
+    if (_sums)
+        _sbc.insert(_sbc.end(),data,data+len);
+}
+
+void video_reset()
+{
+    _beam_pts = -1;
+}
+
+int video_jit(Frame* f, int64_t pts, int64_t until, int* first)
+{
+    video_shown();
+    _jit_frame = f;
+    _jit_pts = pts;
+    int now = beam_line()/BEAM_LINES;
+    int d = _beam ? beam_due(pts) : now + 1;
+    if (d <= now)
+        return 0;
+    _jit_first = _jit_scanned = *first = d*FB_SLICES;
+    return _beam && until > pts ? max(1,(int)(until/1500 - pts/1500)) : 1;
+}
+
+int video_strip()
+{
+    std::lock_guard<std::mutex> lock(_beam_lock);
+    int line = (int)_beam_now;
+    int y = min(max((line % BEAM_LINES - BEAM_TOP)/FB_SLICE_HEIGHT,0),FB_SLICES);
+    int strip = line/BEAM_LINES*FB_SLICES + y;
+    for (; _jit_frame && _jit_scanned < strip && _jit_scanned < _jit_first + FB_SLICES; _jit_scanned++) {
+        int k = _jit_scanned - _jit_first;
+        memcpy(_scanned._slices[k],_jit_frame->_slices[k],FB_STRIDE*FB_SLICE_HEIGHT);
+    }
+    for (; _rel_frame && _rel_scanned < strip && _rel_scanned < _rel_first + FB_SLICES; _rel_scanned++) {
+        int k = _rel_scanned - _rel_first;
+        if (!_rel_frame->_packed)
+            memcpy(_rel_copy._slices[k],_rel_frame->_slices[k],FB_STRIDE*FB_SLICE_HEIGHT);
+    }
+    return strip;
+}
+
+// moves the beam to the line below strip s
+void video_wait_strip(int s)
+{
+    beam_move((int64_t)(s/FB_SLICES)*BEAM_LINES + BEAM_TOP + (s%FB_SLICES + 1)*FB_SLICE_HEIGHT);
+    video_strip();
+}
+
+void video_blank()
+{
+    video_shown();
+}
+
+void video_jit_end()
+{
+    beam_wait(_jit_first/FB_SLICES + 1);
+    while (_jit_scanned < _jit_first + FB_SLICES)
+        video_strip();
+    show(&_scanned,_jit_pts);
+}
+
+//====================================================================================
+//====================================================================================
+
+static uint64_t now_us()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+extern "C" void decoder_thread(void* arg)
+{
+    ((MpegDecoder*)arg)->run();
+}
+
+// same as ESPFlix::decode_next
+static int decode_next(MpegDecoder& decoder, Streamer& streamer)
+{
+    Buffer* b = decoder.pop_empty();
+    if (!b)
+        return -1;
+    int n = (int)streamer.read(b->data,(int)sizeof(b->data));
+    b->len = n;
+    decoder.push_full(b);
+    return n;
+}
+
+FILE* _sums_out = 0;
+map<string,vector<string>> _golden;    // clip -> checksum lines
+
+static int load_sums(const char* path)
+{
+    FILE* f = fopen(path,"r");
+    if (!f) {
+        printf("can't open %s\n",path);
+        return -1;
+    }
+    char line[1024];
+    while (fgets(line,sizeof(line),f)) {
+        char* s = strchr(line,' ');
+        if (!s)
+            continue;
+        *s++ = 0;
+        s[strcspn(s,"\r\n")] = 0;
+        _golden[line].push_back(s);
+    }
+    fclose(f);
+    return 0;
+}
+
+// write the clip's checksums or compare them to the golden ones, returns mismatches
+static int check_sums(const char* name)
+{
+    _frame_sums.push_back(pcm_sum());
+    if (_sums_out) {
+        for (auto& s : _frame_sums)
+            fprintf(_sums_out,"%s %s\n",name,s.c_str());
+        return 0;
+    }
+    auto g = _golden.find(name);
+    if (g == _golden.end()) {
+        printf("%s: no golden checksums\n",name);
+        return 1;
+    }
+    int bad = 0;
+    size_t n = max(g->second.size(),_frame_sums.size());
+    for (size_t i = 0; i < n; i++) {
+        const char* want = i < g->second.size() ? g->second[i].c_str() : "";
+        const char* got = i < _frame_sums.size() ? _frame_sums[i].c_str() : "";
+        if (strcmp(want,got)) {
+            if (!bad)
+                printf("%s: expected '%s' got '%s'\n",name,want,got);
+            bad++;
+        }
+    }
+    return bad;
+}
+
+static int bench(MpegDecoder& decoder, const char* name, int loops, bool pipelined)
+{
+    Streamer streamer;
+    bench_stats total = {};
+    uint64_t elapsed = 0;
+    int bad = 0;
+
+    for (int i = 0; i < loops; i++) {
+        int len;
+        const uint8_t* synth = synth_clip(name,len);
+        if (strcmp(name,"splash") == 0)
+            streamer.get_rom(splash_ts,sizeof(splash_ts));
+        else if (strcmp(name,"vmedia") == 0)
+            streamer.get_rom(vmedia,sizeof(vmedia));
+        else if (synth)
+            streamer.get_rom(synth,len);
+        else if (streamer.get(name)) {
+            printf("can't open %s\n",name);
+            return -1;
+        }
+        bool trick = _trick_step && !_plain_pass;
+        if (trick) {
+            streamer.get_rom(_trick_clip,0);    // dry, trick_next fetches the first range
+            _trick_next = _trick_step > 0 ? 0 : (int)_iframes.size()-1;
+        }
+
+        memset(&_stats,0,sizeof(_stats));
+        _frame_sums.clear();
+        _sbc.clear();
+        _clip_mb = MBStats();
+        _first_loop = i == 0;
+        _frames[0].erase();
+        _frames[1].erase();
+        decoder.reset();
+        uint64_t t = now_us();
+        _clip_start = t;
+        _beam_now = 0;
+        clear_events(DECODER_PAUSED);   // still set from the last run until the decoder wakes
+        set_events(DECODER_RUN);
+        while (trick ? trick_next(decoder,streamer) : decode_next(decoder,streamer))
+            ;
+        wait_events(DECODER_PAUSED);
+        _stats.late_strips = decoder._jit_late;
+        if (trick)
+            decoder.flush_picture(1);   // the last I picture, nothing follows it to push it out
+        elapsed += now_us() - t - _stats.hash_us;
+        streamer.close();
+        if (_plain_pass) {
+            total.frames += _stats.frames;
+            continue;
+        }
+        if (_sums && (!_sums_out || i == 0))
+            bad += check_sums(name);
+        if (_mb_out && _first_loop)
+            mb_summary(name);
+        if (_y4m) {
+            fclose(_y4m);   // first loop only
+            _y4m = 0;
+        }
+
+        total.frames += _stats.frames;
+        total.audio_bytes += _stats.audio_bytes;
+        total.picture_ticks += _stats.picture_ticks;
+        total.predict_ticks += _stats.predict_ticks;
+        total.block_ticks += _stats.block_ticks;
+        total.idct_ticks += _stats.idct_ticks;
+        total.vlc_ticks += _stats.vlc_ticks;
+        total.render_ticks += _stats.render_ticks;
+        total.release_ticks += _stats.release_ticks;
+        total.late += _stats.late;
+        total.late_strips += _stats.late_strips;
+        total.waits += decoder._release_waits;
+    }
+
+    _last_elapsed = elapsed;
+    _last_frames = total.frames;
+    int fps100 = elapsed ? (int)(total.frames*100000000ULL/elapsed) : 0;
+    if (_plain_pass) {
+        printf("%s: plain %d.%02d fps\n",name,fps100/100,fps100%100);
+        return 0;
+    }
+    printf("%s: %d frames, %d audio bytes in %dms, %d.%02d fps\n",name,total.frames,total.audio_bytes,
+           (int)(elapsed/1000),fps100/100,fps100%100);
+    if (_beam)
+        printf("%s: %d pictures late, %d rows waited for the beam, %d early releases drawn over\n",name,
+            total.late,total.waits,_rel_bad);
+    int late = total.late + total.late_strips;
+    if (late)
+        printf("%s: %d pictures and %d B picture strips late against the virtual beam\n",name,total.late,total.late_strips);
+#ifdef MPEG_PROFILE
+    // pipelined, stage two runs on its own thread outside of the picture ticks
+    uint64_t p = total.picture_ticks;
+    if (pipelined)
+        p += total.render_ticks;
+    uint64_t other = p - total.predict_ticks - total.block_ticks;
+    printf("%s: %d ticks/frame predict:%d%% block:%d%% (vlc:%d%% idct:%d%%) other:%d%%\n",name,
+           total.frames ? (int)(p/total.frames) : 0,pct(total.predict_ticks,p),pct(total.block_ticks,p),
+           pct(total.vlc_ticks,p),pct(total.idct_ticks,p),pct(other,p));
+    printf("%s: parse:%d%% render:%d%%\n",name,pct(p - total.render_ticks,p),pct(total.render_ticks,p));
+    if (total.release_ticks)
+        printf("%s: %d ticks/frame blocked on early release, not in the above\n",name,
+            total.frames ? (int)(total.release_ticks/total.frames) : 0);
+#else
+    (void)pipelined;
+#endif
+    if (_sums && !_sums_out)
+        printf("%s: %s\n",name,bad ? "CHECKSUMS DIFFER" : "checksums match");
+    return bad || _rel_bad || late ? -1 : 0;
+}
+
+#if MPEG_PACKED_FRAMES
+// a plain run to compare with, then the packed one
+static int bench_packed(MpegDecoder& decoder, const char* name, int loops, bool pipelined)
+{
+    _plain_pass = true;
+    _plain_y.clear();
+    int err = bench(decoder,name,loops,pipelined);
+    _plain_pass = false;
+    if (err)
+        return err;
+    uint64_t plain_us = _last_elapsed;
+    int plain_frames = _last_frames;
+
+    int freed = decoder.set_packed(_packed_bits);
+    memset(_drift_psnr,0,sizeof(_drift_psnr));
+    memset(_drift_count,0,sizeof(_drift_count));
+    _since_i = 0;
+    err = bench(decoder,name,loops,pipelined);
+    decoder.set_packed(0);
+
+    int strip = FB_STRIDE*FB_SLICE_HEIGHT + 4;
+    int plain_bytes = 2*FB_SLICES*strip;
+    uint64_t a = _last_frames ? _last_elapsed*1000/_last_frames : 0;   // ns a frame
+    uint64_t b = plain_frames ? plain_us*1000/plain_frames : 0;
+    int cache = (MPEG_PACKED_CACHE + 2 + 1)*strip;    // render, the B picture helper and the display's line
+    printf("%s: packed %d bits a pixel: frames %d bytes instead of %d plus %d of plain strips, %d saved, decode time %d%% of plain\n",
+        name,_packed_bits,plain_bytes - freed,plain_bytes,cache,freed - cache,b ? (int)(a*100/b) : 0);
+    printf("%s: luma psnr by pictures since I:",name);
+    for (int i = 0; i < DRIFT_PICTURES; i++) {
+        if (_drift_count[i]) {
+            int p = (int)(_drift_psnr[i]*100/_drift_count[i]);
+            printf(" %d:%d.%02d",i,p/100,p%100);
+        }
+    }
+    printf("\n");
+    return err;
+}
+#endif
+
+// a plain run to check the I pictures against, then trick play
+static int bench_trick(MpegDecoder& decoder, const char* name, int loops, bool pipelined)
+{
+    int len;
+    if (!(_trick_clip = clip_data(name,len))) {
+        printf("can't open %s\n",name);
+        return -1;
+    }
+    find_iframes(_trick_clip,len);
+    _plain_pass = true;
+    _plain_hashes.clear();
+    int err = bench(decoder,name,1,pipelined);
+    _plain_pass = false;
+    if (err)
+        return err;
+
+    _trick_bad = 0;
+    _trick_bytes = 0;
+    decoder.set_trick(TRICK_INTERVAL);
+    err = bench(decoder,name,loops,pipelined);
+    decoder.set_trick(0);
+    printf("%s: trick play every %d of %d I pictures, %d of %d bytes fetched, %d pictures differ from the plain decode\n",
+        name,_trick_step,(int)_iframes.size(),(int)(_trick_bytes/loops),len,_trick_bad);
+    return err || _trick_bad ? -1 : 0;
+}
+
+// a plain run for the pictures to seek to, then a seek to every step-th one
+static int bench_seek(MpegDecoder& decoder, const char* name, int loops, bool pipelined)
+{
+    int len;
+    const uint8_t* clip = clip_data(name,len);
+    if (!clip) {
+        printf("can't open %s\n",name);
+        return -1;
+    }
+    find_iframes(clip,len);
+    _plain_pass = true;
+    _plain_hashes.clear();
+    _plain_pts.clear();
+    int err = bench(decoder,name,1,pipelined);
+    _plain_pass = false;
+    if (err || _iframes.empty())
+        return err ? err : -1;
+
+    int seeks = 0, wrong = 0, dropped = 0;
+    uint64_t total_us = 0, max_us = 0, off = 0;
+    for (int i = 0; i < loops; i++) {
+        for (size_t k = 0; k < _plain_pts.size(); k += _seek_step) {
+            int64_t target = _plain_pts[k];
+            int r = 0;
+            for (int j = 0; j < (int)_iframes.size(); j++)
+                if (_iframes[j].pts <= target)
+                    r = j;
+            int end = r+2 < (int)_iframes.size() ? _iframes[r+2].first*188 : len;    // leading B pictures of the next
+            Streamer streamer;
+            streamer.get_rom(clip + _iframes[r].first*188,end - _iframes[r].first*188);
+            memset(&_stats,0,sizeof(_stats));
+            _frames[0].erase();
+            _frames[1].erase();
+            decoder.reset();
+            decoder.set_seek(target);
+            _seek_shown = -1;
+            _seek_start = _clip_start = now_us();
+            _beam_now = 0;
+            clear_events(DECODER_PAUSED);
+            set_events(DECODER_RUN);
+            while (decode_next(decoder,streamer))
+                ;
+            wait_events(DECODER_PAUSED);
+
+            seeks++;
+            total_us += _seek_us;
+            max_us = max(max_us,_seek_us);
+            dropped += decoder._seek_dropped;
+            off += target - _iframes[r].pts;
+            if (_seek_shown != target || _seek_hash != _plain_hashes[target])
+                wrong++;
+        }
+    }
+    int avg = seeks ? (int)(total_us/10/seeks) : 0;
+    int drop = seeks ? dropped*100/seeks : 0;
+    printf("%s: %d seeks, first picture after %d.%02dms on average, %d.%02dms at worst, %d.%02d pictures not shown\n",
+        name,seeks,avg/100,avg%100,(int)(max_us/1000),(int)(max_us/10%100),drop/100,drop%100);
+    printf("%s: the random access point is %dms before the target on average, %d seeks showed the wrong picture\n",
+        name,seeks ? (int)(off/90/seeks) : 0,wrong);
+    return wrong ? -1 : 0;
+}
+
+// -J, workers can't be stopped so each count runs in a child process of its own that writes back its
+// decode time. Returns the count in a child, 0 in the parent when the sweep is done and -1 on failure
+static int sweep_workers(int most, int* fd)
+{
+    uint64_t one = 0;
+    int err = 0;
+    printf("slice workers 1 to %d on %d cores\n",most,(int)sysconf(_SC_NPROCESSORS_ONLN));
+    for (int n = 1; n <= most; n++) {
+        int p[2];
+        if (pipe(p))
+            return -1;
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(p[0]);
+            *fd = p[1];
+            return n;
+        }
+        close(p[1]);
+        uint64_t us = 0;
+        int status = -1;
+        bool ok = read(p[0],&us,sizeof(us)) == sizeof(us);
+        close(p[0]);
+        waitpid(pid,&status,0);
+        if (!ok || status || !us) {
+            printf("workers %d: failed\n",n);
+            err = -1;
+            continue;
+        }
+        if (n == 1)
+            one = us;
+        int x100 = (int)(one*100/us);
+        printf("workers %d: %dms, %d.%02dx the speed of one\n",n,(int)(us/1000),x100/100,x100%100);
+    }
+    return err;
+}
+
+int main(int argc, const char* argv[])
+{
+    int loops = 1;
+    int threads = 0;
+    int sweep = 0;
+    bool pipelined = false;
+    bool alias = false;
+    bool luma_only = false;
+    bool release = false;
+    int reduced = 0;
+    vector<string> clips;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i],"-n") == 0 && i+1 < argc)
+            loops = atoi(argv[++i]);
+        else if (strcmp(argv[i],"-j") == 0 && i+1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i],"-J") == 0 && i+1 < argc)
+            sweep = atoi(argv[++i]);
+        else if (strcmp(argv[i],"-p") == 0)
+            pipelined = true;
+        else if (strcmp(argv[i],"-a") == 0)
+            alias = true;
+        else if (strcmp(argv[i],"-y") == 0)
+            luma_only = true;
+        else if (strcmp(argv[i],"-s") == 0 && i+1 < argc)
+            set_simd(atoi(argv[++i]));
+        else if (strcmp(argv[i],"-d") == 0 && i+1 < argc)
+            _deadline_fps = atoi(argv[++i]);
+        else if (strcmp(argv[i],"-b") == 0 && i+1 < argc)
+            _beam = atoi(argv[++i]);
+        else if (strcmp(argv[i],"-r") == 0)
+            release = true;
+        else if (strcmp(argv[i],"-e") == 0 && i+1 < argc)
+            _seek_step = max(atoi(argv[++i]),1);
+        else if (strcmp(argv[i],"-f") == 0 && i+1 < argc)
+            _trick_step = atoi(argv[++i]);
+        else if (strcmp(argv[i],"-t") == 0 && i+1 < argc)
+            reduced = atoi(argv[++i]);
+        else if (strcmp(argv[i],"-k") == 0 && i+1 < argc)
+            _packed_bits = atoi(argv[++i]);
+        else if (strcmp(argv[i],"-w") == 0 && i+1 < argc) {
+            if (!(_sums_out = fopen(argv[++i],"w"))) {
+                printf("can't write %s\n",argv[i]);
+                return 1;
+            }
+            _sums = true;
+        } else if (strcmp(argv[i],"-o") == 0 && i+1 < argc) {
+            if (!(_y4m = fopen(argv[++i],"wb"))) {
+                printf("can't write %s\n",argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i],"-m") == 0 && i+1 < argc) {
+#ifndef MPEG_STATS
+            printf("build with -DMPEG_STATS for -m\n");
+            return 1;
+#endif
+            if (!(_mb_out = fopen(argv[++i],"w"))) {
+                printf("can't write %s\n",argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i],"-c") == 0 && i+1 < argc) {
+            if (load_sums(argv[++i]))
+                return 1;
+            _sums = true;
+        } else
+            clips.push_back(argv[i]);
+    }
+    if (clips.empty()) {
+        clips.push_back("splash");
+        clips.push_back("vmedia");
+        clips.push_back("synth");
+        clips.push_back("synth_b");
+    }
+
+    const char* simd[] = {"scalar","sse2","avx2"};
+    printf("kernels: %s\n",simd[simd_level()]);
+    int sweep_fd = -1;
+    if (sweep) {
+        int n = sweep_workers(sweep,&sweep_fd);
+        if (n <= 0)
+            return n ? 1 : 0;
+        threads = n;
+    }
+
+    Frame fb[2];
+    fb[0].init();
+    fb[1].init();
+    _frames = fb;
+    MpegDecoder* decoder = _decoder = new MpegDecoder(&fb[0],&fb[1]);
+    decoder->set_workers(threads);
+    if (pipelined)
+        decoder->set_pipeline();
+    decoder->set_alias(alias);
+    decoder->set_luma_only(luma_only);
+    if (reduced && reduced != 4 && reduced != 8) {
+        printf("-t is 4 or 8\n");
+        return 1;
+    }
+    decoder->set_reduced(reduced);
+    _scanned.init();
+    if (_beam) {
+        decoder->set_jit_strips(_beam);
+        _rel_copy.init();
+        decoder->set_early_release(release);
+    }
+    if (_packed_bits) {
+        if (!MPEG_PACKED_FRAMES) {
+            printf("-k needs MPEG_PACKED_FRAMES\n");
+            return 1;
+        }
+        if (_packed_bits != 2 && _packed_bits != 3) {
+            printf("-k is 2 or 3 bits a pixel\n");
+            return 1;
+        }
+        _unpacked.init();
+    }
+    start_thread(decoder_thread,decoder);
+
+    int err = 0;
+    uint64_t elapsed = 0;
+    for (auto& c : clips) {
+        err |=
+#if MPEG_PACKED_FRAMES
+            _packed_bits ? bench_packed(*decoder,c.c_str(),loops,pipelined) :
+#endif
+            _trick_step ? bench_trick(*decoder,c.c_str(),loops,pipelined) :
+            _seek_step ? bench_seek(*decoder,c.c_str(),loops,pipelined) : bench(*decoder,c.c_str(),loops,pipelined);
+        elapsed += _last_elapsed;
+    }
+    if (sweep_fd >= 0 && write(sweep_fd,&elapsed,sizeof(elapsed)) != sizeof(elapsed))
+        err = 1;
+    if (_sums_out)
+        fclose(_sums_out);
+    if (_mb_out)
+        fclose(_mb_out);
+    fflush(stdout);
+    _exit(err ? 1 : 0);    // decoder thread is parked in pause()
+}
@@ -0,0 +1,562 @@
+//
+//  synth.h
+//
+//  Synthetic MPEG-1 clips for the bench, generated in memory from a fixed seed.
+//  They cover syntax the embedded clips never use: pictures that aren't whole macroblocks or are larger
+//  than the frame, loaded quantizer matrices, slices that span rows or start mid row, skip runs across rows
+//  and past a macroblock escape, full pel and long motion vectors, every coefficient code length and
+//  both escape forms, D pictures. The content is noise, only the syntax means anything.
+//  MPEG-1 has no field pictures.
+//
+//  synth       I and P pictures at 200x120 with loaded matrices, then cropped from 400x224, then D pictures
+//  synth_b     B pictures of every macroblock type, skipped ones repeating the prediction, at 200x120 and
+//              then 352x192, an open GOP in the middle of the second
+//
+
+#define SYNTH_PTS_STEP 3003     // 29.97Hz
+#define SYNTH_ADDR_ESCAPE "00000001000"
+
+// ISO 11172-2 annex B, codes as strings of bits
+
+// B.1 macroblock_address_increment 1..33
+static const char* synth_addr_inc[34] = {
+    0,"1","011","010","0011","0010","00011","00010","0000111","0000110","00001011","00001010",
+    "00001001","00001000","00000111","00000110","0000010111","0000010110","0000010101","0000010100",
+    "0000010011","0000010010","00000100011","00000100010","00000100001","00000100000","00000011111",
+    "00000011110","00000011101","00000011100","00000011011","00000011010","00000011001","00000011000"
+};
+
+// B.2 macroblock_type, quant 0x10 forward 0x08 backward 0x04 pattern 0x02 intra 0x01
+typedef struct {
+    int type;
+    const char* code;
+} SynthType;
+
+static const SynthType synth_types_i[] = {
+    {0x01,"1"},{0x11,"01"}
+};
+static const SynthType synth_types_p[] = {
+    {0x0A,"1"},{0x02,"01"},{0x08,"001"},{0x01,"00011"},{0x1A,"00010"},{0x12,"00001"},{0x11,"000001"}
+};
+static const SynthType synth_types_b[] = {
+    {0x0C,"10"},{0x0E,"11"},{0x04,"010"},{0x06,"011"},{0x08,"0010"},{0x0A,"0011"},{0x01,"00011"},
+    {0x1E,"00010"},{0x1A,"000011"},{0x16,"000010"},{0x11,"000001"}
+};
+
+// B.3 coded_block_pattern 1..63
+static const char* synth_cbp[64] = {
+    0,"01011","01001","001101","1101","0010111","0010011","00011111","1100","0010110","0010010",
+    "00011110","10011","00011011","00010111","00010011","1011","0010101","0010001","00011101","10001",
+    "00011001","00010101","00010001","001111","00001111","00001101","000000011","01111","00001011",
+    "00000111","000000111","1010","0010100","0010000","00011100","001110","00001110","00001100",
+    "000000010","10000","00011000","00010100","00010000","01110","00001010","00000110","000000110",
+    "10010","00011010","00010110","00010010","01101","00001001","00000101","000000101","01100",
+    "00001000","00000100","000000100","111","01010","01000","001100"
+};
+
+// B.4 motion_code by magnitude, a sign bit follows all but 0
+static const char* synth_motion[17] = {
+    "1","01","001","0001","000011","0000101","0000100","0000011","000001011","000001010","000001001",
+    "0000010001","0000010000","0000001111","0000001110","0000001101","0000001100"
+};
+
+// B.5 dct_dc_size_luminance and chrominance 0..8
+static const char* synth_dc_luma[9] = {"100","00","01","101","110","1110","11110","111110","1111110"};
+static const char* synth_dc_chroma[9] = {"00","01","10","110","1110","11110","111110","1111110","11111110"};
+
+// B.5 dct_coeff_next, a sample of every length from 2 to 16 bits. The rest go out as escapes
+typedef struct {
+    int run;
+    int level;
+    const char* code;
+} SynthCoeff;
+
+static const SynthCoeff synth_coeffs[] = {
+    {0,1,"11"},{1,1,"011"},{0,2,"0100"},{2,1,"0101"},{0,3,"00101"},{3,1,"00111"},{4,1,"00110"},
+    {1,2,"000110"},{5,1,"000111"},{6,1,"000101"},{7,1,"000100"},{2,2,"0000100"},{9,1,"0000101"},
+    {0,4,"0000110"},{8,1,"0000111"},{13,1,"00100000"},{0,6,"00100001"},{12,1,"00100010"},
+    {11,1,"00100011"},{3,2,"00100100"},{1,3,"00100101"},{0,5,"00100110"},{10,1,"00100111"},
+    {16,1,"0000001000"},{5,2,"0000001001"},{0,7,"0000001010"},{2,3,"0000001011"},{1,4,"0000001100"},
+    {15,1,"0000001101"},{14,1,"0000001110"},{4,2,"0000001111"},{0,11,"000000010000"},
+    {0,8,"000000011101"},{17,1,"000000011111"},{1,5,"000000011011"},{0,12,"0000000011010"},
+    {22,1,"0000000011111"},{0,16,"00000000011111"},{0,31,"00000000010000"},{0,32,"000000000011000"},
+    {1,8,"000000000011111"},{1,18,"0000000000010000"},{6,3,"0000000000010100"},{27,1,"0000000000011111"}
+};
+
+class Synth {
+public:
+    vector<uint8_t> ts;
+
+    Synth(uint32_t seed) : _seed(seed) {}
+    void sequence(int w, int h, bool matrices);
+    void pictures(const char* order);   // display order of I, P, B or D, must end on a reference
+
+private:
+    uint32_t _seed;
+    vector<uint8_t> _es;                // the picture and its headers, one PES
+    uint32_t _acc = 0;
+    int _bits = 0;
+    int _cc = 0;
+    int _shown = 0;                     // pictures in display order so far
+    int _w = 0, _h = 0;
+    int _mb_w = 0, _mb_h = 0;
+    int _lim_w = 0, _lim_h = 0;         // pels of the picture the frame holds, predictions stay inside
+    bool _matrices = false;
+    uint8_t _intra_q[64];
+    uint8_t _non_intra_q[64];
+
+    // picture being generated
+    int _type = 0;
+    int _full[2];                       // forward and backward
+    int _r_size[2];
+    int _pred[2][2];                    // motion vector predictors, forward and backward h,v
+    int _dc[3];
+
+    int rnd(int n) {
+        _seed = _seed*1103515245 + 12345;
+        return (int)((_seed >> 16) % n);
+    }
+    bool chance(int pct) { return rnd(100) < pct; }
+
+    void put(uint32_t v, int n) {
+        while (n--) {
+            _acc = (_acc << 1) | ((v >> n) & 1);
+            if (++_bits == 8) {
+                _es.push_back(_acc);
+                _acc = _bits = 0;
+            }
+        }
+    }
+    void code(const char* s) {
+        while (*s)
+            put(*s++ - '0',1);
+    }
+    void align() {
+        while (_bits)
+            put(0,1);
+    }
+    void start(int c) {
+        align();
+        put(1,24);
+        put(c,8);
+    }
+
+    void headers(int leading, int tr);
+    void picture(int type, int tr);
+    void slices();
+    void d_slices();
+    int mb_type();
+    bool inside(int x, int y, int h, int v, int full);
+    bool vectors_inside(int x, int y, int dir);
+    void motion(int d, int x, int y);
+    void motion_code(int d, int delta);
+    void dc(int c, int value);
+    void coeff(int run, int level, bool first);
+    void block(int b, bool intra, int x, int y);
+    void pes(int64_t pts);
+};
+
+void Synth::sequence(int w, int h, bool matrices)
+{
+    _w = w;
+    _h = h;
+    _mb_w = (w + 15) >> 4;
+    _mb_h = (h + 15) >> 4;
+    _lim_w = min(_mb_w*16,FB_WIDTH);
+    _lim_h = min(_mb_h*16,FB_HEIGHT);
+    _matrices = matrices;
+    for (int i = 0; i < 64; i++) {
+        _intra_q[i] = i ? 8 + rnd(56) : 8;
+        _non_intra_q[i] = 8 + rnd(56);
+    }
+}
+
+// sequence header and GOP in front of an I picture or the first D, leading is the B pictures shown before it
+void Synth::headers(int leading, int tr)
+{
+    start(0xB3);
+    put(_w,12);
+    put(_h,12);
+    put(1,4);               // square pels
+    put(4,4);               // 29.97
+    put(0x3FFFF,18);        // variable bit rate
+    put(1,1);
+    put(20,10);             // vbv_buffer_size
+    put(0,1);
+    put(_matrices,1);
+    if (_matrices)
+        for (int i = 0; i < 64; i++)
+            put(_intra_q[i],8);
+    put(_matrices,1);
+    if (_matrices)
+        for (int i = 0; i < 64; i++)
+            put(_non_intra_q[i],8);
+
+    int t = _shown + tr - leading;
+    start(0xB8);
+    put(0,1);               // drop frame
+    put(0,5);
+    put(t/(30*60),6);
+    put(1,1);
+    put(t/30 % 60,6);
+    put(t % 30,6);
+    put(leading == 0,1);    // closed
+    put(0,1);
+}
+
+void Synth::pictures(const char* order)
+{
+    int n = (int)strlen(order);
+    int gop = 0;
+    vector<int> pending;    // B pictures waiting for the reference after them
+    for (int i = 0; i < n; i++) {
+        if (order[i] == 'B') {
+            pending.push_back(i);
+            continue;
+        }
+        _es.clear();
+        if (order[i] == 'I' || i == 0) {
+            gop = i - (int)pending.size();
+            headers((int)pending.size(),i);
+        }
+        picture(order[i] == 'I' ? 1 : order[i] == 'P' ? 2 : 4,i - gop);
+        pes(90000 + (int64_t)(_shown + i)*SYNTH_PTS_STEP);
+        for (int b : pending) {
+            _es.clear();
+            picture(3,b - gop);
+            pes(90000 + (int64_t)(_shown + b)*SYNTH_PTS_STEP);
+        }
+        pending.clear();
+    }
+    _shown += n;
+}
+
+void Synth::picture(int type, int tr)
+{
+    _type = type;
+    start(0x00);
+    put(tr & 0x3FF,10);
+    put(type,3);
+    put(0xFFFF,16);         // vbv_delay
+    for (int d = 0; d < 2; d++) {
+        _full[d] = chance(20);
+        _r_size[d] = rnd(3);
+    }
+    if (type == 2 || type == 3) {
+        put(_full[0],1);
+        put(_r_size[0] + 1,3);
+    }
+    if (type == 3) {
+        put(_full[1],1);
+        put(_r_size[1] + 1,3);
+    }
+    put(0,1);               // extra_bit_picture
+    if (type == 4)
+        d_slices();
+    else
+        slices();
+}
+
+// D pictures are DC only intra macroblocks, a slice a row
+void Synth::d_slices()
+{
+    for (int y = 0; y < _mb_h; y++) {
+        start(y + 1);
+        put(1 + rnd(31),5);
+        put(0,1);
+        _dc[0] = _dc[1] = _dc[2] = 128;
+        for (int x = 0; x < _mb_w; x++) {
+            code(synth_addr_inc[1]);
+            code("1");
+            for (int b = 0; b < 6; b++)
+                dc(b < 4 ? 0 : b - 3,rnd(256));
+            put(1,1);       // end_of_macroblock
+        }
+    }
+}
+
+// a random type for the picture, not skipped
+int Synth::mb_type()
+{
+    int k = rnd(100);
+    switch (_type) {
+        case 1: return k < 20 ? 0x11 : 0x01;
+        case 2: return k < 5 ? 0x01 : k < 8 ? 0x11 : k < 30 ? 0x08 : k < 58 ? 0x0A : k < 75 ? 0x02 :
+            k < 88 ? 0x1A : 0x12;
+    }
+    return k < 5 ? 0x01 : k < 7 ? 0x11 : k < 20 ? 0x0C : k < 35 ? 0x0E : k < 45 ? 0x04 : k < 58 ? 0x06 :
+        k < 68 ? 0x08 : k < 80 ? 0x0A : k < 88 ? 0x1E : k < 94 ? 0x1A : 0x16;
+}
+
+// prediction of the macroblock at x,y by h,v stays inside the picture held by the frame
+bool Synth::inside(int x, int y, int h, int v, int full)
+{
+    if (x >= (FB_WIDTH >> 4) || y >= FB_SLICES)
+        return true;        // cropped, never reconstructed
+    int x2 = 32*x + h*(1 << full);
+    int y2 = 32*y + v*(1 << full);
+    return x2 >= 0 && y2 >= 0 && x2 + (x2 & 1) <= 2*(_lim_w - 16) && y2 + (y2 & 1) <= 2*(_lim_h - 16);
+}
+
+bool Synth::vectors_inside(int x, int y, int dir)
+{
+    return (!(dir & 0x08) || inside(x,y,_pred[0][0],_pred[0][1],_full[0])) &&
+        (!(dir & 0x04) || inside(x,y,_pred[1][0],_pred[1][1],_full[1]));
+}
+
+// B.4 and 2.4.4.2, delta from the predictor in motion_code and motion_r
+void Synth::motion_code(int d, int delta)
+{
+    int f = 1 << _r_size[d];
+    if (delta < -16*f)
+        delta += 32*f;
+    if (delta > 16*f - 1)
+        delta -= 32*f;
+    if (f == 1 || delta == 0) {
+        code(synth_motion[abs(delta)]);
+        if (delta)
+            put(delta < 0,1);
+        return;
+    }
+    int a = abs(delta) - 1;
+    code(synth_motion[a/f + 1]);
+    put(delta < 0,1);
+    put(a % f,_r_size[d]);
+}
+
+// new forward (0) or backward (1) vector of the macroblock at x,y
+void Synth::motion(int d, int x, int y)
+{
+    int f = 1 << _r_size[d];
+    int h, v;
+    do {
+        int k = rnd(100);
+        if (k < 25) {
+            h = _pred[d][0];
+            v = _pred[d][1];
+        } else if (k < 40)
+            h = v = 0;
+        else if (k < 80) {
+            h = _pred[d][0] + rnd(9) - 4;
+            v = _pred[d][1] + rnd(9) - 4;
+        } else {
+            h = rnd(32*f) - 16*f;
+            v = rnd(32*f) - 16*f;
+        }
+        h = min(max(h,-16*f),16*f - 1);
+        v = min(max(v,-16*f),16*f - 1);
+    } while (!inside(x,y,h,v,_full[d]));
+    motion_code(d,h - _pred[d][0]);
+    motion_code(d,v - _pred[d][1]);
+    _pred[d][0] = h;
+    _pred[d][1] = v;
+}
+
+// dct_dc_differential of component c, 0 luma 1 cb 2 cr, to value
+void Synth::dc(int c, int value)
+{
+    int diff = value - _dc[c];
+    int size = 0;
+    while ((1 << size) <= abs(diff))
+        size++;
+    code(c ? synth_dc_chroma[size] : synth_dc_luma[size]);
+    if (size)
+        put(diff > 0 ? diff : diff + (1 << size) - 1,size);
+    _dc[c] = value;
+}
+
+void Synth::coeff(int run, int level, bool first)
+{
+    int a = abs(level);
+    if (first && run == 0 && a == 1) {
+        code("1");          // dct_coeff_first
+        put(level < 0,1);
+        return;
+    }
+    for (auto& c : synth_coeffs) {
+        if (c.run == run && c.level == a) {
+            code(c.code);
+            put(level < 0,1);
+            return;
+        }
+    }
+    code("000001");
+    put(run,6);
+    if (a < 128)
+        put(level & 0xFF,8);
+    else {
+        put(level < 0 ? 0x80 : 0x00,8);
+        put(level < 0 ? level + 256 : level,8);
+    }
+}
+
+void Synth::block(int b, bool intra, int x, int y)
+{
+    int pos = 0;
+    if (intra) {
+        if (b < 4)
+            dc(0,min(max(40 + (x*16 + y*9 + _shown*5) % 160 + rnd(17) - 8,0),255));
+        else
+            dc(b - 3,128 + rnd(81) - 40);
+        pos = 1;
+    }
+    int n = intra ? rnd(4) : 1 + rnd(4);
+    for (int i = 0; i < n; i++) {
+        int run, level;
+        int k = rnd(100);
+        if (k < 70) {
+            const SynthCoeff& c = synth_coeffs[rnd(sizeof(synth_coeffs)/sizeof(synth_coeffs[0]))];
+            run = c.run;
+            level = c.level;
+        } else if (k < 90) {
+            run = rnd(8);
+            level = 1 + rnd(40);    // 8 bit escapes
+        } else {
+            run = rnd(4);
+            level = 128 + rnd(128); // 16 bit escapes
+        }
+        if (pos + run > 63)
+            break;
+        if (chance(50))
+            level = -level;
+        coeff(run,level,!intra && i == 0);
+        pos += run + 1;
+    }
+    code("10");             // end_of_block
+}
+
+void Synth::slices()
+{
+    int n = _mb_w*_mb_h;
+    int last = 0;           // address of the last coded macroblock
+    int skipped = 0;        // since then
+    int burst = 0;          // long run of skips in progress
+    int dir = 0;            // prediction of the last macroblock of a B picture, 0 after intra
+    bool first = true;      // of the slice
+    for (int a = 0; a < n; a++) {
+        int x = a % _mb_w;
+        int y = a / _mb_w;
+
+        // slices start at the top, at the start of rows or mid row and run on across rows
+        if (a == 0 || (!skipped && (chance(5) || (x == 0 && chance(30))))) {
+            start(y + 1);
+            put(1 + rnd(31),5);
+            put(0,1);
+            _pred[0][0] = _pred[0][1] = _pred[1][0] = _pred[1][1] = 0;
+            _dc[0] = _dc[1] = _dc[2] = 128;
+            last = y*_mb_w - 1;
+            dir = 0;
+            first = true;
+        }
+
+        // skipped, never first or last of a slice or after intra in a B picture
+        bool can_skip = !first && a < n-1 && _type != 1 && (_type == 2 || (dir && vectors_inside(x,y,dir)));
+        if (can_skip && !burst && chance(3))
+            burst = 30 + rnd(25);   // past a macroblock escape
+        if (can_skip && (burst || chance(20))) {
+            skipped++;
+            burst = max(burst - 1,0);
+            if (_type == 2)
+                _pred[0][0] = _pred[0][1] = 0;
+            _dc[0] = _dc[1] = _dc[2] = 128;
+            continue;
+        }
+        burst = 0;
+
+        int inc = a - last;
+        while (inc > 33) {
+            code(SYNTH_ADDR_ESCAPE);
+            inc -= 33;
+        }
+        code(synth_addr_inc[inc]);
+        last = a;
+        skipped = 0;
+        first = false;
+
+        int t = mb_type();
+        const SynthType* types = _type == 1 ? synth_types_i : _type == 2 ? synth_types_p : synth_types_b;
+        while (types->type != t)
+            types++;
+        code(types->code);
+        if (t & 0x10)
+            put(1 + rnd(31),5);
+
+        if (t & 0x01) {
+            _pred[0][0] = _pred[0][1] = _pred[1][0] = _pred[1][1] = 0;
+            dir = 0;
+            for (int b = 0; b < 6; b++)
+                block(b,true,x,y);
+            continue;
+        }
+        _dc[0] = _dc[1] = _dc[2] = 128;
+        if (t & 0x08)
+            motion(0,x,y);
+        else if (_type == 2)
+            _pred[0][0] = _pred[0][1] = 0;
+        if (t & 0x04)
+            motion(1,x,y);
+        dir = _type == 3 ? t & 0x0C : 0x08;
+        if (t & 0x02) {
+            int cbp = 1 + rnd(63);
+            code(synth_cbp[cbp]);
+            for (int b = 0; b < 6; b++)
+                if (cbp & (0x20 >> b))
+                    block(b,false,x,y);
+        }
+    }
+}
+
+// one PES of _es on pid 0x100, the last packet is padded with adaptation field stuffing
+void Synth::pes(int64_t pts)
+{
+    align();
+    uint8_t h[14] = {0,0,1,0xE0,0,0,0x80,0x80,5,
+        (uint8_t)(0x21 | ((pts >> 29) & 0x0E)),(uint8_t)(pts >> 22),(uint8_t)((pts >> 14) | 1),
+        (uint8_t)(pts >> 7),(uint8_t)((pts << 1) | 1)};
+    _es.insert(_es.begin(),h,h + sizeof(h));
+    for (size_t i = 0; i < _es.size();) {
+        int n = (int)min(_es.size() - i,(size_t)184);
+        uint8_t p[188] = {0x47,(uint8_t)(i ? 0x01 : 0x41),0x00,(uint8_t)(0x10 | (_cc++ & 15))};
+        int o = 4;
+        if (n < 184) {
+            p[3] |= 0x20;
+            p[o++] = 184 - n - 1;
+            if (n < 183) {
+                p[o++] = 0;
+                memset(p + o,0xFF,183 - n - 1);
+                o += 183 - n - 1;
+            }
+        }
+        memcpy(p + o,&_es[i],n);
+        ts.insert(ts.end(),p,p + 188);
+        i += n;
+    }
+}
+
+// the clips by name, generated on first use
+static const uint8_t* synth_clip(const char* name, int& len)
+{
+    static map<string,vector<uint8_t> > clips;
+    auto c = clips.find(name);
+    if (c != clips.end()) {
+        len = (int)c->second.size();
+        return c->second.data();
+    }
+    Synth s(1);
+    if (strcmp(name,"synth") == 0) {
+        s.sequence(200,120,true);
+        s.pictures("IPPPPPPPIPPP");
+        s.sequence(400,224,false);
+        s.pictures("IPPPPP");
+        s.sequence(352,192,false);
+        s.pictures("DDD");
+    } else if (strcmp(name,"synth_b") == 0) {
+        s.sequence(200,120,true);
+        s.pictures("IBPBBPBBP");
+        s.sequence(352,192,false);
+        s.pictures("IBBPBBPBBPBBIBBPBP");
+    } else
+        return 0;
+    len = (int)s.ts.size();
+    return (clips[name] = s.ts).data();
+}
@@ -0,0 +1,183 @@
+//
+//  yuvcmp.cpp
+//
+//  Per frame PSNR and SSIM of decoded video against a reference decode.
+//  Either file can be y4m or raw planar 4:2:0 (-s WxH), the reference is usually
+//  ffmpeg -i video.ts -pix_fmt yuv420p ref.y4m
+//
+//  g++ -O2 yuvcmp.cpp -o yuvcmp
+//  ./bench -o test.y4m file:///path/video.ts
+//  ./yuvcmp [-s 352x192] [-q] test.y4m ref.y4m
+//
+//  -q prints the averages only. Frames are paired in order, the shorter file ends the run.
+//
+
+#include "stdlib.h"
+#include "stdio.h"
+#include "string.h"
+#include "stdint.h"
+#include "math.h"
+
+#include <vector>
+using namespace std;
+
+//====================================================================================
+//====================================================================================
+// y4m or raw 4:2:0 reader
+
+typedef struct {
+    FILE* f;
+    bool y4m;
+    int width;
+    int height;
+    vector<uint8_t> yuv;    // Y then Cb then Cr
+} YUVFile;
+
+static int yuv_open(YUVFile& y, const char* path, int width, int height)
+{
+    y.f = fopen(path,"rb");
+    if (!y.f) {
+        printf("can't open %s\n",path);
+        return -1;
+    }
+    y.width = width;
+    y.height = height;
+    char hdr[256];
+    y.y4m = fread(hdr,1,9,y.f) == 9 && memcmp(hdr,"YUV4MPEG2",9) == 0;
+    if (y.y4m) {
+        if (!fgets(hdr,sizeof(hdr),y.f))
+            return -1;
+        for (char* t = strtok(hdr," \n"); t; t = strtok(0," \n")) {
+            if (t[0] == 'W')
+                y.width = atoi(t+1);
+            else if (t[0] == 'H')
+                y.height = atoi(t+1);
+            else if (t[0] == 'C' && strncmp(t,"C420",4)) {
+                printf("%s: only 4:2:0 is supported\n",path);
+                return -1;
+            }
+        }
+    } else
+        rewind(y.f);
+    if (y.width <= 0 || y.height <= 0) {
+        printf("%s: raw yuv needs -s WxH\n",path);
+        return -1;
+    }
+    y.yuv.resize(y.width*y.height*3/2);
+    return 0;
+}
+
+static bool yuv_read(YUVFile& y)
+{
+    if (y.y4m) {
+        char hdr[256];
+        if (!fgets(hdr,sizeof(hdr),y.f) || strncmp(hdr,"FRAME",5))
+            return false;
+    }
+    return fread(&y.yuv[0],1,y.yuv.size(),y.f) == y.yuv.size();
+}
+
+//====================================================================================
+//====================================================================================
+// Metrics
+
+static double psnr(const uint8_t* a, const uint8_t* b, int n)
+{
+    uint64_t sse = 0;
+    for (int i = 0; i < n; i++) {
+        int d = a[i] - b[i];
+        sse += d*d;
+    }
+    if (!sse)
+        return 99.99;   // identical
+    return 10*log10(255.0*255.0*n/sse);
+}
+
+// mean SSIM over 8x8 windows stepped by 4
+static double ssim(const uint8_t* a, const uint8_t* b, int width, int height)
+{
+    const double c1 = (0.01*255)*(0.01*255);
+    const double c2 = (0.03*255)*(0.03*255);
+    double total = 0;
+    int windows = 0;
+    for (int y = 0; y + 8 <= height; y += 4) {
+        for (int x = 0; x + 8 <= width; x += 4) {
+            int sa = 0, sb = 0, saa = 0, sbb = 0, sab = 0;
+            for (int j = 0; j < 8; j++) {
+                const uint8_t* pa = a + (y+j)*width + x;
+                const uint8_t* pb = b + (y+j)*width + x;
+                for (int i = 0; i < 8; i++) {
+                    sa += pa[i];
+                    sb += pb[i];
+                    saa += pa[i]*pa[i];
+                    sbb += pb[i]*pb[i];
+                    sab += pa[i]*pb[i];
+                }
+            }
+            double ma = sa/64.0, mb = sb/64.0;
+            double va = saa/64.0 - ma*ma;
+            double vb = sbb/64.0 - mb*mb;
+            double cov = sab/64.0 - ma*mb;
+            total += ((2*ma*mb + c1)*(2*cov + c2))/((ma*ma + mb*mb + c1)*(va + vb + c2));
+            windows++;
+        }
+    }
+    return windows ? total/windows : 1;
+}
+
+int main(int argc, const char* argv[])
+{
+    int width = 0, height = 0;
+    bool quiet = false;
+    const char* path[2] = {0,0};
+    int paths = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i],"-s") == 0 && i+1 < argc)
+            sscanf(argv[++i],"%dx%d",&width,&height);
+        else if (strcmp(argv[i],"-q") == 0)
+            quiet = true;
+        else if (paths < 2)
+            path[paths++] = argv[i];
+    }
+    if (paths != 2) {
+        printf("usage: yuvcmp [-s WxH] [-q] test.y4m ref.y4m\n");
+        return 1;
+    }
+
+    YUVFile a,b;
+    if (yuv_open(a,path[0],width,height) || yuv_open(b,path[1],width,height))
+        return 1;
+    if (a.width != b.width || a.height != b.height) {
+        printf("size mismatch %dx%d vs %dx%d\n",a.width,a.height,b.width,b.height);
+        return 1;
+    }
+
+    int w = a.width, h = a.height;
+    int ny = w*h, nc = (w/2)*(h/2);
+    double sum_y = 0, sum_u = 0, sum_v = 0, sum_ssim = 0, min_y = 99.99;
+    int frames = 0;
+    while (yuv_read(a) && yuv_read(b)) {
+        const uint8_t* pa = &a.yuv[0];
+        const uint8_t* pb = &b.yuv[0];
+        double y = psnr(pa,pb,ny);
+        double u = psnr(pa+ny,pb+ny,nc);
+        double v = psnr(pa+ny+nc,pb+ny+nc,nc);
+        double s = ssim(pa,pb,w,h);
+        if (!quiet)
+            printf("%d psnr y:%.2f u:%.2f v:%.2f ssim:%.4f\n",frames,y,u,v,s);
+        sum_y += y;
+        sum_u += u;
+        sum_v += v;
+        sum_ssim += s;
+        if (y < min_y)
+            min_y = y;
+        frames++;
+    }
+    if (!frames) {
+        printf("no frames\n");
+        return 1;
+    }
+    printf("%d frames avg psnr y:%.2f u:%.2f v:%.2f min y:%.2f ssim:%.4f\n",frames,
+           sum_y/frames,sum_u/frames,sum_v/frames,min_y,sum_ssim/frames);
+    return 0;
+}
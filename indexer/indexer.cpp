@@ -27,9 +27,11 @@ typedef struct {
     uint32_t sample_count;
 } idx_rec;
 
+// len 4: the sample tables are followed by the I picture of each video sample, {pos188,packets}.
+// Trick play range requests them from video.ts, the fwd/rev streams are only made for older players.
 typedef struct {
     uint32_t sig;
-    uint32_t len;   // 3
+    uint32_t len;   // 4
     idx_rec video;
     idx_rec fwd;
     idx_rec rev;
@@ -77,6 +79,7 @@ static int parse(const uint8_t* d, const uint8_t* end, int64_t& pts, int64_t& dt
 typedef struct {
     int64_t pts;
     uint32_t pos188;
+    uint32_t packets;   // up to the next video PES, the I picture
 } seq;
 
 typedef struct {
@@ -84,6 +87,7 @@ typedef struct {
     int64_t first_pts;
     int64_t last_pts;
     vector<uint32_t> samples;
+    vector<uint32_t> iframes;   // pos188,packets of each sample
 } idx;
 
 // find all the pts points in the video
@@ -110,6 +114,11 @@ void make_index(const string& src, vector<idx>& idxs)
     vector<seq> audio;
 
     printf(">%s index\n",src.c_str());
+    if (!f) {
+        printf("no %s\n",src.c_str());
+        idxs.push_back({seqs,0,0});
+        return;
+    }
     // get all the sequence start data
     for (;;) {
         size_t n = fread(buf,1,sizeof(buf),f);
@@ -126,10 +135,12 @@ void make_index(const string& src, vector<idx>& idxs)
                     int m = parse(data,d+188,pts,dts);
                     switch (pid) {
                         case 0x100:     // video
+                            if (seqs.size() && !seqs.back().packets)
+                                seqs.back().packets = packet - seqs.back().pos188;
                             if (m == 0xB3) {    // start of sequence
                                 if (origin == -1)
                                     origin = pts;
-                                seqs.push_back({pts,(uint32_t)packet});
+                                seqs.push_back({pts,(uint32_t)packet,0});
                                 if (gop_pts == -1)
                                     gop_pts = pts;
                                 else {
@@ -165,6 +176,8 @@ void make_index(const string& src, vector<idx>& idxs)
         }
     }
     fclose(f);
+    if (seqs.size() && !seqs.back().packets)
+        seqs.back().packets = packet - seqs.back().pos188;
 
     printf("Audio between %dms early and %dms late\n",(int)(audio_delta_max/90),(int)(audio_delta_min/90));
     printf("Max video frame packets was %d (%dk), max gop bitrate was %dkbit/s\n",max_frame_packets,max_frame_packets*188/1024,video_kbits);
@@ -175,27 +188,25 @@ void make_index(const string& src, vector<idx>& idxs)
 // map a pts in fwd and reverse
 // map from a random access point in the trick streams to the main stream
 // by default pts delay is 129750/90000 or ~1.5 seconds in ffmpeg
+// the last random access point at or before pts, so a seek can decode forward to pts
 static
-uint32_t pts2pos(int64_t pts, vector<seq>& s)
+int pts2seq_index(int64_t pts, vector<seq>& s)
 {
     int mini = 0;
-    int mine = 0x7FFFFFF;
-    for (int i = 0; i < s.size(); i++) {
-        int e = (int)abs(s[i].pts-pts);
-        if (e < mine) {
-            mine = e;
-            mini = i;
-        }
-    }
-    return s[mini].pos188;
+    for (int i = 0; i < s.size() && s[i].pts <= pts; i++)
+        mini = i;
+    return mini;
 }
 
 idx_rec pts2seq(idx& id, int speedx, int bin_size)
 {
     int64_t end = id.last_pts-id.first_pts;
     int64_t pts = 0;
-    while (pts <= end) {
-        id.samples.push_back(pts2pos(pts+id.first_pts,id.seqs));    // zero based
+    while (id.seqs.size() && pts <= end) {
+        const seq& s = id.seqs[pts2seq_index(pts+id.first_pts,id.seqs)];
+        id.samples.push_back(s.pos188);     // zero based
+        id.iframes.push_back(s.pos188);
+        id.iframes.push_back(s.packets);
         pts += bin_size;
     }
 
@@ -222,7 +233,7 @@ void merge_index(vector<idx>& all, const string& path)
 
     idx_hdr hdr;
     hdr.sig = ('I' << 0) | ('D' << 8) | ('X' << 16);
-    hdr.len = 3;
+    hdr.len = 4;
     hdr.video = pts2seq(video,1,90000/12);
     hdr.fwd = pts2seq(fwd,speedx,90000/12);
     hdr.rev = pts2seq(rwd,speedx,90000/12);
@@ -231,8 +242,9 @@ void merge_index(vector<idx>& all, const string& path)
     FILE* f = fopen(p.c_str(),"wb");
     fwrite(&hdr,1,sizeof(hdr),f);
     fwrite(&video.samples[0],1,4*video.samples.size(),f);
-    fwrite(&fwd.samples[0],1,4*fwd.samples.size(),f);
-    fwrite(&rwd.samples[0],1,4*rwd.samples.size(),f);
+    fwrite(fwd.samples.data(),1,4*fwd.samples.size(),f);     // empty without trick streams
+    fwrite(rwd.samples.data(),1,4*rwd.samples.size(),f);
+    fwrite(&video.iframes[0],1,4*video.iframes.size(),f);
     fclose(f);
 }
 
@@ -299,7 +311,8 @@ bool remake(const string& path, bool force)
 // ffmpeg -y -i video.mp4 -filter:v "crop=992:546:144:0" -bf 0 -b:v 2000k -s 352x192 out.mp4
 // ffmpeg -y -i video.mp4 -vf cropdetect=24:16:0 dummy.mp4
 
-void make_video(const string& src, const string& dst, bool clean = false)
+// trick_streams encodes video_fwd.ts and video_rwd.ts for players without I picture trick play
+void make_video(const string& src, const string& dst, bool clean = false, bool trick_streams = false)
 {
     char buf[2048];
     const char* ffmpeg = "/usr/local/bin/ffmpeg";
@@ -318,11 +331,11 @@ void make_video(const string& src, const string& dst, bool clean = false)
         sprintf(buf,video,ffmpeg,src.c_str(),dst.c_str());
         exec(buf);
     }
-    if (remake(dst + "/video_fwd.ts",clean)) {
+    if (trick_streams && remake(dst + "/video_fwd.ts",clean)) {
         sprintf(buf,fwd,ffmpeg,dst.c_str(),dst.c_str());
         exec(buf);
     }
-    if (remake(dst + "/video_rwd.ts",clean)) {
+    if (trick_streams && remake(dst + "/video_rwd.ts",clean)) {
         sprintf(buf,rwd,ffmpeg,dst.c_str(),dst.c_str());
         exec(buf);
     }
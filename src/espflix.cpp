@@ -227,7 +227,7 @@ public:
     void draw_text(int x, int y, const string& txt)
     {
         if (x == -1)
-            x = (352-_render.measure_text(txt.c_str()))/2;   // center
+            x = (FB_WIDTH-_render.measure_text(txt.c_str()))/2;   // center
         _render.draw_text(x,y,txt.c_str());
     }
 
@@ -527,6 +527,18 @@ public:
 
 #define BOOT "http://rossumur.s3.amazonaws.com/espflix/service.txt"
 
+// I picture trick play, content skipped per picture shown as a multiple of the pts between them
+#ifndef ESPFLIX_TRICK_SPEED
+#define ESPFLIX_TRICK_SPEED 30
+#endif
+#ifndef ESPFLIX_TRICK_INTERVAL
+#define ESPFLIX_TRICK_INTERVAL (90000/6)
+#endif
+// I picture ranges read from video.idx in one request, 8 bytes each
+#ifndef ESPFLIX_TRICK_WINDOW
+#define ESPFLIX_TRICK_WINDOW 64
+#endif
+
 extern "C" void demux_thread(void* arg);
 extern "C" void audio_thread(void* arg);
 void up_key();
@@ -570,6 +582,14 @@ class ESPFlix {
     int _nav = -1;
     int _speed = 0;
 
+    // trick play from the I pictures of video.ts, one every _trick_speed*ESPFLIX_TRICK_INTERVAL of content
+    bool _iframes = false;
+    int _trick_speed = ESPFLIX_TRICK_SPEED;
+    int64_t _trick_pos;         // main pts of the last I picture fetched
+    uint32_t _trick_packet;     // and its first packet
+    vector<uint8_t> _trick_ranges; // ESPFLIX_TRICK_WINDOW records of video.idx from _trick_at
+    uint32_t _trick_at;
+
     // indexes allow us to move from normal/fwd/rwd timestamps and random access points in video.
     typedef struct {
         int64_t first_pts;
@@ -579,9 +599,10 @@ class ESPFlix {
         uint32_t sample_count;
     } idx_rec;
 
+    // len 4 adds the I picture of each video sample after the sample tables, {pos188,packets}
     typedef struct idx_hdr {
         uint32_t sig;
-        uint32_t len;   // 3
+        uint32_t len;   // 3 or 4
         idx_rec video;
         idx_rec fwd;
         idx_rec rwd;
@@ -626,6 +647,13 @@ class ESPFlix {
             }
             return offset*4 + sizeof(idx_hdr);
         }
+
+        // main pts to the I picture range of its random access point
+        uint32_t iframe_offset(int64_t pts)
+        {
+            uint32_t i = pts2offset(pts,0) - sizeof(idx_hdr);
+            return sizeof(idx_hdr) + (video.sample_count + fwd.sample_count + rwd.sample_count)*4 + i*2;
+        }
     } idx_hdr;
 
     typedef struct {
@@ -653,6 +681,11 @@ public:
         //gen_palettes();
         _frame_buffers[0].init();
         _frame_buffers[1].init();
+        _decoder.set_early_release(true);   // start the next picture while the last field of the old one is scanned
+#ifdef ESPFLIX_LUMA_ONLY
+        _decoder.set_luma_only(true);   // monochrome displays
+        video_luma_only(1);
+#endif
         _pictures = 0;
         start_thread(demux_thread,this);
         start_thread(audio_thread,0,1);
@@ -729,6 +762,8 @@ public:
 
         PLOG(REQUEST_BUFFER);
         int n = (int)_streamer.read(b->data,(int)sizeof(b->data));
+        if (n == 0 && _iframes && next_iframe())
+            n = (int)_streamer.read(b->data,(int)sizeof(b->data));
         PLOG(RECEIVED_BUFFER);
 
         b->len = n;     // may be n, 0, or -1
@@ -784,14 +819,19 @@ public:
             set_state(NAV);
     }
 
-    void play(int i, int speed = 0, uint32_t offset = 0)
+    // seek: pictures before this pts are decoded but not shown
+    void play(int i, int speed = 0, uint32_t offset = 0, int64_t seek = -1)
     {
         show_progress(speed == 0 ? 180 : -1);
         printf("playing at offset %d\n",offset);
         const char* s = _vid_names[speed+1];
         _speed = speed;
+        _iframes = false;
+        _decoder.set_reduced(speed ? MPEG_TRICK_SCALE : 0);    // trick pictures only flash by
+        _decoder.set_trick(0);
         stream(folder(i) + s,offset);
         _decoder.reset();
+        _decoder.set_seek(seek);
         video_reset();
         set_state(PLAYING);
         set_events(DECODER_RUN);
@@ -808,7 +848,7 @@ public:
             pause();
         } else {
             if (_state == NAV) {
-                play(_nav,0,get_index(0,_info[_nav].pos)*188);
+                play_at(_info[_nav].pos);
             } else if (_state == PAUSED) {
                 video_pause(0);
                 set_events(DECODER_RUN);
@@ -828,30 +868,88 @@ public:
         return *((uint32_t*)&buf[0]);
     }
 
-    void fast_forward()
+    // range request the next I picture at the trick speed, false past either end.
+    // Its record comes from a window of them read ahead in the direction of play, one request a picture
+    // and one every ESPFLIX_TRICK_WINDOW bins of the index
+    bool next_iframe()
+    {
+        auto& idx = _info[_nav].idx;
+        for (int i = 0; i < 16; i++) {  // slow speeds can land on the picture just shown
+            _trick_pos += (int64_t)_speed*_trick_speed*ESPFLIX_TRICK_INTERVAL;
+            if (_trick_pos < idx.video.first_pts || _trick_pos > idx.video.last_pts)
+                return false;
+            uint32_t at = idx.iframe_offset(_trick_pos);
+            if (_trick_ranges.empty() || at < _trick_at || at + 8 > _trick_at + _trick_ranges.size()) {
+                uint32_t first = idx.iframe_offset(idx.video.first_pts);
+                _trick_at = _speed > 0 ? at : max(at,first + (ESPFLIX_TRICK_WINDOW-1)*8) - (ESPFLIX_TRICK_WINDOW-1)*8;
+                if (_streamer.get_url((folder(_nav) + "/video.idx").c_str(),_trick_ranges,_trick_at,ESPFLIX_TRICK_WINDOW*8) ||
+                    at + 8 > _trick_at + _trick_ranges.size()) {
+                    _trick_ranges.clear();
+                    return false;
+                }
+            }
+            const uint32_t* r = (const uint32_t*)&_trick_ranges[at - _trick_at];
+            if (r[0] == _trick_packet)
+                continue;
+            _trick_packet = r[0];
+            return _streamer.get((folder(_nav) + "/video.ts").c_str(),r[0]*188,r[1]*188) == 0;
+        }
+        return false;
+    }
+
+    // I pictures of video.ts shown at the trick cadence, older indexes use the fwd/rwd streams
+    void trick_play(int speed)
     {
         auto& n = _info[_nav];
-        play(_nav,1,get_index(1,n.pos)*188);
+        if (n.idx.len < 4) {
+            play(_nav,speed,get_index(speed,n.pos)*188);
+            return;
+        }
+        show_progress(-1);
+        _speed = speed;
+        _iframes = true;
+        _trick_pos = max(min(n.pos,n.idx.video.last_pts),n.idx.video.first_pts);
+        _trick_pos -= (int64_t)speed*_trick_speed*ESPFLIX_TRICK_INTERVAL;    // first one is at pos
+        _trick_packet = -1;
+        _trick_ranges.clear();      // another title or another direction
+        _decoder.reset();
+        _decoder.set_reduced(MPEG_TRICK_SCALE);
+        _decoder.set_trick(ESPFLIX_TRICK_INTERVAL);
+        video_reset();
+        _streamer.idle();           // decode_next fetches the first I picture as it does the rest
+        set_state(PLAYING);
+        set_events(DECODER_RUN);
+    }
+
+    void fast_forward()
+    {
+        trick_play(1);
     }
 
     void rewind()
     {
-        auto& n = _info[_nav];
-        play(_nav,-1,get_index(-1,n.pos)*188);
+        trick_play(-1);
     }
 
     void skip(int s)
     {
         auto& n = _info[_nav];
         n.pos += s*90000;
-        play(_nav,0,get_index(0,n.pos)*188);
+        play_at(n.pos);
+    }
+
+    // from the random access point before pos, decoding up to it without showing
+    void play_at(int64_t pos)
+    {
+        auto& idx = _info[_nav].idx;
+        play(_nav,0,get_index(0,pos)*188,min(pos,idx.video.last_pts));
     }
 
     // just paused, save main pts
     void save_pos(int64_t pts, bool write2nv)
     {
         printf("save_pos from %s->",pts_str(pts));
-        pts = _info[_nav].idx.pts2pts(pts,_speed);
+        pts = _info[_nav].idx.pts2pts(pts,_iframes ? 0 : _speed);
         printf("%s %d\n",pts_str(pts),_speed);
         _info[_nav].pos = pts;
         if (write2nv)
@@ -863,7 +961,7 @@ public:
     {
         if (_nav == -1)
             return; // in splash screen
-        int64_t pts = _info[_nav].idx.pts2pts(_decoder.get_pts(),_speed);   // main pts
+        int64_t pts = _info[_nav].idx.pts2pts(_decoder.get_pts(),_iframes ? 0 : _speed);   // main pts
         int seconds = (int)(pts/90000);
         if (seconds != _last_seconds) {
             int i = _speed == 0 ? (_state == PAUSED ? PAUSE : PLAY) : (_speed == 1 ? FFWD : RWND);
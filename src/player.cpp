@@ -17,8 +17,8 @@ using namespace std;
 #include "player.h"
 #include "streamer.h"
 
-// Frame Buffer is for a 352x192 display
-// 16x(352*3/2) == 8448 byte chunks
+// Frame Buffer is FB_WIDTH x FB_HEIGHT, 352x192 by default
+// 16x(FB_WIDTH*3/2) byte chunks, 8448 at 352
 // YYYYUU
 // YYYYVV
 
@@ -27,6 +27,7 @@ void Frame::init()
     for (int i = 0; i < FB_SLICES; i++) {
         _slices[i] = (uint8_t*)malloc32(FB_STRIDE*FB_SLICE_HEIGHT + 4,"FB");  // +4 is to allow overread in mocomp
         memset(_slices[i],0,FB_STRIDE*FB_SLICE_HEIGHT + 4);
+        _spare[i] = 0;
     }
 }
 
@@ -45,12 +46,290 @@ uint8_t* IRAM_ATTR Frame::get_cb(int y)
     return _slices[y >> 3] + ((y&0x7) + 8)*FB_STRIDE + FB_WIDTH;
 }
 
+#if MPEG_PACKED_FRAMES
+static void fill_packed(Frame* f, int from, int to, uint8_t c);
+#endif
+
+void Frame::fill_chroma(uint8_t c)
+{
+#if MPEG_PACKED_FRAMES
+    if (_packed) {
+        fill_packed(this,FB_WIDTH/2,FB_WIDTH*3/4,c);
+        return;
+    }
+#endif
+    for (int i = 0; i < FB_SLICES; i++)
+        for (int y = 0; y < FB_SLICE_HEIGHT; y++)
+            memset(_slices[i] + y*FB_STRIDE + FB_WIDTH,c,FB_WIDTH/2);
+}
+
 void Frame::erase()
 {
+    unalias();
+#if MPEG_PACKED_FRAMES
+    if (_packed) {
+        fill_packed(this,0,FB_WIDTH*3/4,0x30);
+        return;
+    }
+#endif
     for (int i = 0; i < FB_SLICES; i++)
         memset(_slices[i],0x30,FB_STRIDE*FB_SLICE_HEIGHT + 4);
 }
 
+// Fully skipped strips can share the reference's memory instead of being copied.
+// Only the reference ever holds aliases, they are handed back when the roles swap.
+void Frame::alias(Frame* f, int i)
+{
+    if (!_spare[i])
+        _spare[i] = _slices[i];
+    _slices[i] = f->_slices[i];
+}
+
+void Frame::release(Frame* f)
+{
+    for (int i = 0; i < FB_SLICES; i++) {
+        if (_spare[i]) {
+            f->_slices[i] = _spare[i];  // we keep the strip we were sharing
+            _spare[i] = 0;
+        }
+    }
+}
+
+void Frame::unalias()
+{
+    for (int i = 0; i < FB_SLICES; i++) {
+        if (_spare[i]) {
+            memcpy(_spare[i],_slices[i],FB_STRIDE*FB_SLICE_HEIGHT);
+            _slices[i] = _spare[i];
+            _spare[i] = 0;
+        }
+    }
+}
+
+#if MPEG_PACKED_FRAMES
+//========================================================================================
+//========================================================================================
+// Packed frames
+// Fixed rate block truncation coding of 4x4 blocks so reference frames fit in less memory.
+// At 2 bits a pixel a block keeps the means of the pixels below and at or above its mean and a bit per pixel,
+// at 3 bits its lowest and highest pixels and 2 bits per pixel choosing them or a level a third between.
+// Blocks go in pairs so they can be read and written a word at a time: a word of both blocks' levels,
+// then the index bits. A strip is 4 rows of pairs of luma blocks, then 2 of cr and 2 of cb.
+
+#define PACKED_PAIRS (FB_WIDTH*3/4)             // in a strip
+#define PAIR_WORDS(_bits) ((_bits) == 3 ? 3 : 2)
+
+static int strip_bytes(int bits)
+{
+    return bits ? PACKED_PAIRS*PAIR_WORDS(bits)*4 : FB_STRIDE*FB_SLICE_HEIGHT + 4;
+}
+
+// first pair of block row r of plane c
+static inline int pair_row(int c, int r)
+{
+    return c ? FB_WIDTH/2 + ((c-1)*2 + r)*(FB_WIDTH/16) : r*(FB_WIDTH/8);
+}
+
+// row y of plane c in a plain strip
+static inline uint32_t* plain_row(uint8_t* s, int c, int y)
+{
+    return (uint32_t*)(s + (y + (c == 2 ? 8 : 0))*FB_STRIDE + (c ? FB_WIDTH : 0));
+}
+
+// levels of a 4x4 block from rows a stride apart, returns the index bits, 4 or 8 a row
+template <int BITS>
+static uint32_t pack_block(const uint32_t* r, uint32_t* levels)
+{
+    int p[16];
+    for (int y = 0; y < 4; y++) {
+        uint32_t w = r[y*(FB_STRIDE >> 2)];
+        for (int x = 0; x < 4; x++)
+            p[y*4 + x] = (w >> (x*8)) & 0xFF;
+    }
+    int lo = 255, hi = 0;
+    uint32_t idx = 0;
+    if (BITS == 3) {
+        for (int i = 0; i < 16; i++) {
+            lo = min(lo,p[i]);
+            hi = max(hi,p[i]);
+        }
+        int range = hi - lo;
+        for (int i = 0; i < 16; i++) {
+            int d = (p[i] - lo)*6;          // nearest of 4, halfway is range/6 apart
+            idx |= ((d >= range) + (d >= range*3) + (d >= range*5)) << (i*2);
+        }
+    } else {
+        int sum = 0, n = 0, above = 0;
+        for (int i = 0; i < 16; i++)
+            sum += p[i];
+        for (int i = 0; i < 16; i++) {
+            if (p[i]*16 >= sum) {
+                idx |= 1 << i;
+                above += p[i];
+                n++;
+            }
+        }
+        hi = (above + n/2)/n;
+        lo = n < 16 ? (sum - above + (16-n)/2)/(16-n) : hi;
+    }
+    *levels = lo | (hi << 8);
+    return idx;
+}
+
+// the levels of a block as bytes of a word, (n*683) >> 11 is n/3 for the sums here
+template <int BITS>
+inline uint32_t IRAM_ATTR block_levels(uint32_t levels)
+{
+    uint32_t lo = levels & 0xFF, hi = (levels >> 8) & 0xFF;
+    if (BITS == 2)
+        return lo | (hi << 8);
+    return lo | ((((lo*2 + hi + 1)*683) >> 11) << 8) | ((((lo + hi*2 + 1)*683) >> 11) << 16) | (hi << 24);
+}
+
+// a row of a block from its levels and the row's index bits
+template <int BITS>
+inline uint32_t IRAM_ATTR block_row(uint32_t levels, uint32_t idx)
+{
+    const int n = BITS-1, mask = (1 << n) - 1;
+    uint32_t w = 0;
+    for (int x = 0; x < 4; x++)
+        w |= ((levels >> (((idx >> (x*n)) & mask)*8)) & 0xFF) << (x*8);
+    return w;
+}
+
+template <int BITS>
+static void pack_pairs(uint32_t* d, const uint8_t* src)
+{
+    for (int c = 0; c < 3; c++) {
+        for (int r = 0; r < (c ? 2 : 4); r++) {
+            const uint32_t* s = plain_row((uint8_t*)src,c,r*4);
+            for (int i = 0; i < (c ? FB_WIDTH/16 : FB_WIDTH/8); i++) {
+                uint32_t a,b;
+                uint32_t ia = pack_block<BITS>(s,&a);
+                uint32_t ib = pack_block<BITS>(s+1,&b);
+                d[0] = a | (b << 16);
+                if (BITS == 3) {
+                    d[1] = ia;
+                    d[2] = ib;
+                } else
+                    d[1] = ia | (ib << 16);
+                d += PAIR_WORDS(BITS);
+                s += 2;
+            }
+        }
+    }
+}
+
+// rows y..y+rows-1 of a row of pairs
+template <int BITS>
+static void IRAM_ATTR unpack_pairs(uint32_t* d, const uint32_t* s, int pairs, int y, int rows)
+{
+    const int row_bits = (BITS-1)*4;
+    for (int i = 0; i < pairs; i++) {
+        uint32_t a = block_levels<BITS>(s[0]);
+        uint32_t b = block_levels<BITS>(s[0] >> 16);
+        uint32_t ia = s[1];
+        uint32_t ib = BITS == 3 ? s[2] : s[1] >> 16;
+        uint32_t* dd = d;
+        for (int r = y; r < y + rows; r++) {
+            dd[0] = block_row<BITS>(a,ia >> (r*row_bits));
+            dd[1] = block_row<BITS>(b,ib >> (r*row_bits));
+            dd += FB_STRIDE >> 2;
+        }
+        s += PAIR_WORDS(BITS);
+        d += 2;
+    }
+}
+
+static void IRAM_ATTR unpack_rows(int bits, uint32_t* d, const uint32_t* s, int pairs, int y, int rows)
+{
+    if (bits == 3)
+        unpack_pairs<3>(d,s,pairs,y,rows);
+    else
+        unpack_pairs<2>(d,s,pairs,y,rows);
+}
+
+// pairs [from,to) of every strip to a flat c
+static void fill_packed(Frame* f, int from, int to, uint8_t c)
+{
+    int words = PAIR_WORDS(f->_packed);
+    for (int i = 0; i < FB_SLICES; i++) {
+        uint32_t* d = (uint32_t*)f->_slices[i] + from*words;
+        for (int j = from; j < to; j++) {
+            d[0] = c | (c << 8) | (c << 16) | (c << 24);
+            for (int k = 1; k < words; k++)
+                d[k] = 0;
+            d += words;
+        }
+    }
+}
+
+// Repack every strip, returns the bytes freed. A plain strip is briefly needed to change between packings.
+int Frame::pack(int bits)
+{
+    if (bits == _packed)
+        return 0;
+    unalias();
+    int from = _packed;
+    uint8_t* plain = from ? (uint8_t*)malloc32(strip_bytes(0),"Frame::pack") : 0;
+    for (int i = 0; i < FB_SLICES; i++) {
+        uint8_t* old = _slices[i];
+        const uint8_t* src = old;
+        if (from) {
+            _packed = from;
+            unpack_strip(i,plain);
+            src = plain;
+        }
+        _slices[i] = (uint8_t*)malloc32(strip_bytes(bits),"FB");
+        _packed = bits;
+        if (bits)
+            pack_strip(i,src);
+        else
+            memcpy(_slices[i],src,strip_bytes(0));
+        free(old);
+    }
+    free(plain);
+    return (strip_bytes(from) - strip_bytes(bits))*FB_SLICES;
+}
+
+void Frame::pack_strip(int i, const uint8_t* src)
+{
+    if (_packed == 3)
+        pack_pairs<3>((uint32_t*)_slices[i],src);
+    else
+        pack_pairs<2>((uint32_t*)_slices[i],src);
+}
+
+void Frame::unpack_strip(int i, uint8_t* dst)
+{
+    const uint32_t* s = (const uint32_t*)_slices[i];
+    for (int c = 0; c < 3; c++)
+        for (int r = 0; r < (c ? 2 : 4); r++)
+            unpack_rows(_packed,plain_row(dst,c,r*4),s + pair_row(c,r)*PAIR_WORDS(_packed),
+                c ? FB_WIDTH/16 : FB_WIDTH/8,0,4);
+}
+
+// The display reads luma row line and chroma rows line/2 and the one below, they land in the same rows of
+// view's strip as they would in a plain one
+void IRAM_ATTR Frame::unpack_line(Frame* view, int line)
+{
+    uint8_t* dst = view->_slices[0];
+    int words = PAIR_WORDS(_packed);
+    int y = line & 15;
+    unpack_rows(_packed,plain_row(dst,0,y),(const uint32_t*)_slices[line >> 4] + pair_row(0,y >> 2)*words,
+        FB_WIDTH/8,y & 3,1);
+    int cy = line >> 1;
+    for (int j = 0; j < 2; j++, cy++) {
+        if (cy >= FB_HEIGHT/2)
+            break;
+        const uint32_t* s = (const uint32_t*)_slices[cy >> 3];
+        for (int c = 1; c < 3; c++)
+            unpack_rows(_packed,plain_row(dst,c,cy & 7),s + pair_row(c,(cy & 7) >> 2)*words,FB_WIDTH/16,cy & 3,1);
+    }
+}
+
+#endif
+
 //========================================================================================
 //========================================================================================
 // Inspired by Java MPEG-1 Video Decoder and Player
@@ -115,6 +394,76 @@ const uint32_t motion_vec[67] = {
     0x0000FFF1,0x0000FFF5,0x0000FFF3
 };
 
+// Multi-bit lookup tables generated from the trees above on startup.
+// Peek VLC.bits and get len:8 value:8, or 0x8000 + offset of a secondary table indexed by the following VLC.sub_bits
+// Longest codes are 11 bits, so one or two table hits per symbol instead of up to 11 tree steps
+
+VLC _mb_addr_inc_vlc;
+VLC _mb_type_I_vlc;
+VLC _mb_type_P_vlc;
+VLC _mb_type_B_vlc;
+VLC _cbp_vlc;
+VLC _motion_vlc;
+
+uint16_t _mb_addr_inc_tab[64 + 4*32];   // 6 bit primary, 4 secondaries
+uint16_t _mb_type_I_tab[4];
+uint16_t _mb_type_P_tab[64];
+uint16_t _mb_type_B_tab[64];
+uint16_t _cbp_tab[32 + 8*16];           // 5 bit primary, 8 secondaries
+uint16_t _motion_tab[64 + 4*32];        // 6 bit primary, 4 secondaries
+
+// walk n bits of code through the tree, returns bits used to reach a leaf or 0 if we ran out
+static int vlc_walk(const uint32_t* vlc, uint8_t& state, int code, int n)
+{
+    for (int i = 1; i <= n; i++) {
+        state = vlc[state] >> (((code >> (n-i)) & 1) ? 16 : 24);
+        if (state == 0xFF || !(vlc[state] >> 24))
+            return i;   // invalid code or leaf
+    }
+    return 0;
+}
+
+static uint16_t vlc_entry(const uint32_t* vlc, uint8_t state, int len)
+{
+    int16_t v = (state == 0xFF) ? 0 : (int16_t)vlc[state];
+    return (len << 8) | (uint8_t)v;
+}
+
+static void make_vlc(VLC& v, const uint32_t* vlc, uint16_t* tab, int bits, int sub_bits)
+{
+    int n = 1 << bits;
+    for (int i = 0; i < (1 << bits); i++) {
+        uint8_t state = 0;
+        int len = vlc_walk(vlc,state,i,bits);
+        if (len) {
+            tab[i] = vlc_entry(vlc,state,len);
+            continue;
+        }
+        tab[i] = 0x8000 | n;  // continue in secondary table
+        for (int j = 0; j < (1 << sub_bits); j++) {
+            uint8_t s = state;
+            len = vlc_walk(vlc,s,j,sub_bits);
+            tab[n+j] = vlc_entry(vlc,s,len);
+        }
+        n += 1 << sub_bits;
+    }
+    v.bits = bits;
+    v.sub_bits = sub_bits;
+    v.tab = tab;
+}
+
+static void make_vlc_tabs()
+{
+    if (_mb_addr_inc_vlc.tab)
+        return;
+    make_vlc(_mb_addr_inc_vlc,macroblock_address_increment,_mb_addr_inc_tab,6,5);
+    make_vlc(_mb_type_I_vlc,macroblock_type_I,_mb_type_I_tab,2,0);
+    make_vlc(_mb_type_P_vlc,macroblock_type_P,_mb_type_P_tab,6,0);
+    make_vlc(_mb_type_B_vlc,macroblock_type_B,_mb_type_B_tab,6,0);
+    make_vlc(_cbp_vlc,coded_block_pattern,_cbp_tab,5,4);
+    make_vlc(_motion_vlc,motion_vec,_motion_tab,6,5);
+}
+
 // not used at runtime
 const uint32_t dct_coeff[224] = {
     0x01020000,0x04030000,0x00000001,0x07080000,0x06050000,0x0D090000,0x0B0A0000,0x0E0C0000,
@@ -181,59 +530,42 @@ const uint8_t default_intra_q[64] = {
 };
 
 // pin between 0-248 to prevent dither overflow
-// TODO. mem access is probably slower than explit check
-const uint8_t _pin[256+256+256] = {
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-    0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0A,0x0B,0x0C,0x0D,0x0E,0x0F,
-    0x10,0x11,0x12,0x13,0x14,0x15,0x16,0x17,0x18,0x19,0x1A,0x1B,0x1C,0x1D,0x1E,0x1F,
-    0x20,0x21,0x22,0x23,0x24,0x25,0x26,0x27,0x28,0x29,0x2A,0x2B,0x2C,0x2D,0x2E,0x2F,
-    0x30,0x31,0x32,0x33,0x34,0x35,0x36,0x37,0x38,0x39,0x3A,0x3B,0x3C,0x3D,0x3E,0x3F,
-    0x40,0x41,0x42,0x43,0x44,0x45,0x46,0x47,0x48,0x49,0x4A,0x4B,0x4C,0x4D,0x4E,0x4F,
-    0x50,0x51,0x52,0x53,0x54,0x55,0x56,0x57,0x58,0x59,0x5A,0x5B,0x5C,0x5D,0x5E,0x5F,
-    0x60,0x61,0x62,0x63,0x64,0x65,0x66,0x67,0x68,0x69,0x6A,0x6B,0x6C,0x6D,0x6E,0x6F,
-    0x70,0x71,0x72,0x73,0x74,0x75,0x76,0x77,0x78,0x79,0x7A,0x7B,0x7C,0x7D,0x7E,0x7F,
-    0x80,0x81,0x82,0x83,0x84,0x85,0x86,0x87,0x88,0x89,0x8A,0x8B,0x8C,0x8D,0x8E,0x8F,
-    0x90,0x91,0x92,0x93,0x94,0x95,0x96,0x97,0x98,0x99,0x9A,0x9B,0x9C,0x9D,0x9E,0x9F,
-    0xA0,0xA1,0xA2,0xA3,0xA4,0xA5,0xA6,0xA7,0xA8,0xA9,0xAA,0xAB,0xAC,0xAD,0xAE,0xAF,
-    0xB0,0xB1,0xB2,0xB3,0xB4,0xB5,0xB6,0xB7,0xB8,0xB9,0xBA,0xBB,0xBC,0xBD,0xBE,0xBF,
-    0xC0,0xC1,0xC2,0xC3,0xC4,0xC5,0xC6,0xC7,0xC8,0xC9,0xCA,0xCB,0xCC,0xCD,0xCE,0xCF,
-    0xD0,0xD1,0xD2,0xD3,0xD4,0xD5,0xD6,0xD7,0xD8,0xD9,0xDA,0xDB,0xDC,0xDD,0xDE,0xDF,
-    0xE0,0xE1,0xE2,0xE3,0xE4,0xE5,0xE6,0xE7,0xE8,0xE9,0xEA,0xEB,0xEC,0xED,0xEE,0xEF,
-    0xF0,0xF1,0xF2,0xF3,0xF4,0xF5,0xF6,0xF7,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-    0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,0xF8,
-};
-const uint8_t* _pin_ = _pin + 256;
-#define PIN(_x) _pin_[(_x)]
+inline uint32_t pin(int v)
+{
+    return v < 0 ? 0 : (v > 248 ? 248 : v);    // min/max, no table lookup
+}
+#define PIN(_x) pin(_x)
+
+// SWAR, 4 pixels per word
+// per byte a + b saturating at 255
+inline uint32_t add_sat(uint32_t a, uint32_t b)
+{
+    uint32_t s = (a & 0x7F7F7F7F) + (b & 0x7F7F7F7F);
+    uint32_t c = ((a & b) | ((a | b) & s)) & 0x80808080;   // carry out of each byte
+    s ^= (a ^ b) & 0x80808080;
+    return s | ((c >> 7)*0xFF);
+}
+
+// per byte min(x,248)
+inline uint32_t pin248(uint32_t x)
+{
+    uint32_t c = x & ((x & 0x7F7F7F7F) + 0x07070707) & 0x80808080;   // x + 7 carries, x > 248
+    uint32_t m = (c >> 7)*0xFF;
+    return (x & ~m) | (0xF8F8F8F8 & m);
+}
+
+// per byte PIN(x + dc)
+inline uint32_t add_pin(uint32_t x, int dc)
+{
+    if (dc >= 0)
+        return pin248(add_sat(x,(uint32_t)min(dc,255)*0x01010101u));
+    return pin248(~add_sat(~x,(uint32_t)min(-dc,255)*0x01010101u));
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(ESP_PLATFORM) && !defined(MPEG_NO_SIMD)
+#include <immintrin.h>
+#define PIXEL_SIMD
+#endif
 
 //========================================================================================
 //========================================================================================
@@ -330,29 +662,88 @@ static const char* marker_name(uint8_t m)
     return c;
 }
 
-#if 0
+// per stage cycle counters, build with MPEG_PROFILE to enable
+#ifdef MPEG_PROFILE
 uint32_t _picture_ticks = 0;
 uint32_t _predict_ticks = 0;
 uint32_t _block_ticks = 0;
 uint32_t _idct_ticks = 0;
 uint32_t _vlc_ticks = 0;
+uint32_t _render_ticks = 0;
+uint32_t _release_ticks = 0;
 #define MEASURE(_m) AddTicks ticks(_m)
+#define MEASURE_BEGIN() uint32_t _t = cpu_ticks()
+#define MEASURE_END(_m) _m += cpu_ticks() - _t
+#ifdef ESP_PLATFORM
 #define REPORT() if (!_picture_ticks) _picture_ticks++; printf("MPEG: %d p:%d%% b:%d%% i:%d%% v:%d%%\n", \
 _picture_ticks/240,_predict_ticks*100/_picture_ticks,_block_ticks*100/_picture_ticks,_idct_ticks*100/_picture_ticks,_vlc_ticks*100/_picture_ticks); \
-_picture_ticks = _block_ticks = _predict_ticks = _idct_ticks = _vlc_ticks = 0;
+_picture_ticks = _block_ticks = _predict_ticks = _idct_ticks = _vlc_ticks = _render_ticks = _release_ticks = 0;
+#else
+#define REPORT() _picture_ticks = _block_ticks = _predict_ticks = _idct_ticks = _vlc_ticks = _render_ticks = _release_ticks = 0;  // host reads them in push_video
+#endif
 #else
 #define MEASURE(_m)
+#define MEASURE_BEGIN()
+#define MEASURE_END(_m)
 #define REPORT()
 #endif
 
+// per picture macroblock statistics
+#ifdef MPEG_STATS
+#define STATS(_x) _x
+#else
+#define STATS(_x)
+#endif
+
+void add_stats(MBStats& d, const MBStats& s)
+{
+    d.intra += s.intra;
+    d.inter += s.inter;
+    d.skipped += s.skipped;
+    for (int i = 0; i < 64; i++)
+        d.cbp[i] += s.cbp[i];
+    for (int i = 0; i < 65; i++)
+        d.coeffs[i] += s.coeffs[i];
+    for (int i = 0; i < 32; i++)
+        d.quant[i] += s.quant[i];
+    for (int i = 0; i < 4; i++)
+        d.half_pel[i] += s.half_pel[i];
+    for (int i = 0; i < 2; i++) {
+        d.mv_min[i] = min(d.mv_min[i],s.mv_min[i]);
+        d.mv_max[i] = max(d.mv_max[i],s.mv_max[i]);
+    }
+}
+
+// refill() guarantees FILL_BYTES contiguous bytes so there is one bounds check per fill, not per byte
+#if MPEG_BITS == 64
+#define FILL_BYTES 4
+#define FILL_BITS() \
+if (_b_count < 32) { \
+    uint32_t w; \
+    if (_end - _data < FILL_BYTES) \
+        refill(); \
+    memcpy(&w,_data,4);     /* unaligned, little endian */ \
+    _b = (_b << 32) | __builtin_bswap32(w); \
+    _data += 4; \
+    _b_count += 32; \
+}
+#else
+#define FILL_BYTES 3
 #define FILL_BITS() \
-while (_b_count < 24) { \
-    _b = (_b << 8) | ((_data < _end) ? *_data++ : more()); \
-    _b_count += 8; \
+if (_b_count < 24) { \
+    if (_end - _data < FILL_BYTES) \
+        refill(); \
+    do { \
+        _b = (_b << 8) | *_data++; \
+        _b_count += 8; \
+    } while (_b_count < 24); \
 }
+#endif
 
-MpegDecoder::MpegDecoder(Frame* fb0, Frame* fb1)
+MpegDecoder::MpegDecoder(Frame* fb0, Frame* fb1, int buffers)
 {
+    make_vlc_tabs();
+
     _fb[0] = fb0;
     _fb[1] = fb1;
     _fb_index = 0;
@@ -360,11 +751,16 @@ MpegDecoder::MpegDecoder(Frame* fb0, Frame* fb1)
     _current = _fb[_fb_index & 1];
     _last_pts = _pts = _audio_pts = -1;
 
+    // batch of one macroblock when reconstruction is inline
+    _batch = new MBBatch();
+    _batch->coeff_size = 6*64;
+    _batch->coeff = (int32_t*)malloc32(_batch->coeff_size*4,"MBBatch");
+
     // reset data source
     _b_count = _b = 0;
     _data = _end = 0;
 
-    for (int i = 0; i < 4; i++)
+    for (int i = 0; i < buffers; i++)
         _empty_q.push(new Buffer());
 }
 
@@ -405,6 +801,8 @@ int MpegDecoder::demux(int pid, const uint8_t* d, const uint8_t* end, int payloa
             dts = parse_pts(d,flags);
     }
     if (pid == 0x100) {
+        if (payload == end)
+            return -1;
         _data = payload;
         _end = end;
         /*
@@ -416,10 +814,14 @@ int MpegDecoder::demux(int pid, const uint8_t* d, const uint8_t* end, int payloa
             PLOG(VIDEO_PES);
         if (pts != -1)
             _pts = pts;
-        return *_data++;
+        return 0;
     }
-    if (pid == 0x101 || pid == 0x102) {
+    if ((pid == 0x101 || pid == 0x102) && !_trick_interval) {
         if (payload_unit_start) {
+            if (pts < _seek_pts) {
+                _audio_pts = -1;            // before the seek target
+                return -1;
+            }
             if (_audio_pts == -1)
                 printf("restarting audio\n");
             _audio_expected = expected;
@@ -448,16 +850,39 @@ void MpegDecoder::reset()
     while (!_full_q.empty())
         _empty_q.push(_full_q.pop());   // release buffers
     video_reset();                      // reset timing
+    _degrade = _on_time = 0;
+    memset(_degrade_pictures,0,sizeof(_degrade_pictures));
+    _bframe_pending = _bframe_shown = false;
+    _refs = 0;
+    _bframe_pictures = _bframe_dropped = _bframe_skipped = _jit_late = 0;
+    _releasing = false;
+    _release_waits = 0;
+    _bad_codes = _bad_slices = 0;
     _last_pts = -1;
     _audio_pts = -1;
+    _trick_pts = 0;
+    _seek_pts = -1;
+    _seek_dropped = 0;
 }
 
-// pad with eos
-const uint8_t _eos[] = { 0x00, 0x00, 0x01, 0xB7, 0x00, 0x00, 0x01, 0xB7 };
+// pad with eos, leading zero ends the last payload, trailing zeros cover the bit reader lookahead
+const uint8_t _eos[] = { 0x00, 0x00, 0x00, 0x01, 0xB7, 0x00, 0x00, 0x01, 0xB7, 0x00, 0x00, 0x00, 0x00 };
+
+// set _data/_end to the next padding
+void MpegDecoder::pad(const uint8_t* d, int len)
+{
+    memcpy(_pad+4,d,len);
+    _data = _pad+4;
+    _end = _data + len;
+}
 
 // Demux transport stream to find new data to decode
-uint8_t MpegDecoder::more()
+// _data/_end point to the next video payload with at least 4 header bytes in front of it
+void MpegDecoder::more()
 {
+    static const uint8_t zeros[4] = {0};
+    if (_parent)
+        return pad(zeros,4);    // end of slice on a worker, pad with zeros
     for (;;) {
         if (_buffer && (_mark == _buffer->len)) {
             _empty_q.push(_buffer);
@@ -467,16 +892,15 @@ uint8_t MpegDecoder::more()
             _buffer = (Buffer*)_full_q.pop();
             _mark = 0;
             if (_buffer->len <= 0) {
-                _data = _eos;
-                _end = _data + sizeof(_eos);
-                return 0;   // No more buffers comming
+                pad(_eos,sizeof(_eos));
+                return;     // No more buffers comming
             }
         }
         uint8_t* d = _buffer->data + _mark;
         _mark += 188;
         if (*d != 0x47) {
             printf("ts lost sync\n");
-            return 0;
+            return pad(zeros,1);
         }
 
         // consume the next transport packet
@@ -485,13 +909,28 @@ uint8_t MpegDecoder::more()
         if (d[3] & 0x20)            // adaptation field
             data = d + 5 + d[4];
         if (d[3] & 0x10) {          // data
-            int b = demux(pid,data,d+188,d[1] & 0x40);
-            if (b != -1)
-                return b;           // another blob of video ready
+            if (demux(pid,data,d+188,d[1] & 0x40) != -1)
+                return;             // another blob of video ready
         }
     }
 }
 
+// Stitch the unread tail of the window in front of the next payload, over its headers.
+// Keeps the window contiguous without copying payloads.
+void MpegDecoder::refill()
+{
+    while (_end - _data < FILL_BYTES) {
+        uint8_t tail[FILL_BYTES-1];
+        int n = (int)(_end - _data);
+        for (int i = 0; i < n; i++)
+            tail[i] = _data[i];
+        more();
+        _data -= n;
+        for (int i = 0; i < n; i++)
+            ((uint8_t*)_data)[i] = tail[i];
+    }
+}
+
 inline
 int MpegDecoder::get_bit()
 {
@@ -514,19 +953,16 @@ int MpegDecoder::get_bits(int n)
 }
 
 inline
-int MpegDecoder::get_vlc(const uint32_t* vlc)
+int MpegDecoder::get_vlc(const VLC& vlc)
 {
     FILL_BITS();
-
-    uint8_t state = 0;
-    int b = _b;
-    int b_count = _b_count; // copy to local regs
-    do {
-        int bit = (b >> --b_count) & 1;
-        state = vlc[state] >> (bit ? 16 : 24);
-    } while (vlc[state] >> 24);
-    _b_count = b_count;
-    return (int16_t)vlc[state];
+    int e = vlc.tab[(_b >> (_b_count - vlc.bits)) & ((1 << vlc.bits)-1)];
+    if (e & 0x8000) {
+        _b_count -= vlc.bits;
+        e = vlc.tab[(e & 0x7FFF) + ((_b >> (_b_count - vlc.sub_bits)) & ((1 << vlc.sub_bits)-1))];
+    }
+    _b_count -= e >> 8;
+    return (int8_t)e;
 }
 
 #define C(_run,_len) (((_run) << 8) | (_len))
@@ -629,9 +1065,11 @@ int MpegDecoder::get_vlc_dct()
         return t_0000001[(pb >> 6) & 7];
     }
 
-    // 12 to 16 bit codes
-    if (pb == 0)
-        printf("this is not a code that should exist");
+    // 12 to 16 bit codes, none has more than 11 leading zeros
+    if (pb < 0x0010) {
+        _bad_codes++;       // damaged streams hit this every block, don't print
+        return C(64,1);     // start code in a block, run past the end so the block is dropped
+    }
 
     int z = 0;
     while (pb < 0x0100)
@@ -672,14 +1110,17 @@ void MpegDecoder::sequence()
     else
         memset(non_intra_q,16,64);
 
-    mb_width = (horizontal_size+15) >> 4;
+    _dq_scale[0] = _dq_scale[1] = -1;
+
+    mb_width = (horizontal_size+15) >> 4;   // macroblocks outside the frame are parsed and dropped
     mb_height = (vertical_size+15) >> 4;
     mb_size = mb_width*mb_height;
 }
 
 void MpegDecoder::gop()
 {
-    int t = get_bits(25);
+    int t = get_bits(1) << 24;  // the 32 bit reader holds 24 at least
+    t |= get_bits(24);
     drop_frame = ((t & 0x1000000) != 0) && (picture_rate != 4);
     hours = (t >> 19) & 0x1F;
     minutes = (t >> 13) & 0x3F;
@@ -691,209 +1132,615 @@ void MpegDecoder::gop()
 
 void MpegDecoder::flush_picture(int mode)
 {
+    STATS(_picture_stats = _mb_stats);
+    STATS(_mb_stats = MBStats());
     if (_last_pts != -1 || mode) {
-        push_video(_fb[0],_fb_index & 1,_last_pts,mode);  // this is the last picture
+        _shown_type = _current_type;
+        bool early = _early_release && !_alias && !mode;   // shared strips can't be handed back early
+        int released = 0;           // set by push_video when early
+        if (!mode && _last_pts < _seek_pts) {
+            _seek_dropped++;                // decoded as a reference only
+            early = false;
+            video_blank();                  // the frame on screen is drawn into next
+        } else {
+            _seek_pts = -1;
+            int64_t pts = _trick_interval ? (_trick_pts += _trick_interval) : _last_pts;   // trick play jumps about
+            int late = push_video(_fb[0],_fb_index & 1,pts,mode,early ? &released : 0);  // this is the last picture
+            if (!mode)
+                degrade(late);
+        }
+        _bframe_shown = false;
         _reference = _fb[_fb_index++ & 1];
         _current = _fb[_fb_index & 1];
+        _reference->release(_current);
+        _releasing = early;
+        _released = released;
     }
     if (!mode)
         _last_pts = _pts;
     REPORT();
 }
 
-void MpegDecoder::picture()
+// Every P picture is a reference so we can't drop frames to catch up, reconstruct them
+// more cheaply instead. Step down a level for each late picture, back up after a run on time.
+void MpegDecoder::degrade(int late)
 {
-    flush_picture();
+    if (late > 0) {
+        if (_degrade < DEGRADE_LEVELS-1)
+            _degrade++;
+        _on_time = 0;
+    } else if (_degrade && ++_on_time >= DEGRADE_RECOVER) {
+        _degrade--;
+        _on_time = 0;
+    }
+    _degrade_pictures[_degrade]++;
+}
 
+void MpegDecoder::picture()
+{
+    drain();
     int temporal_reference = get_bits(10);
-    picture_coding_type = get_bits(3);
+    int type = get_bits(3);
+
+    // a kept B picture is shown until the next picture in display order
+    if (_bframe_pending)
+        present_b(type == B_FRAME ? _pts : _last_pts);
+    if (type == I_FRAME || type == P_FRAME)
+        flush_picture();    // the B pictures in front of it have been shown, D pictures aren't decoded
+    if (_luma_only && !_chroma_filled) {
+        MEASURE(_picture_ticks);
+        if (_releasing)
+            wait_released(FB_SLICES-1);
+        _fb[0]->fill_chroma(0x80);
+        _fb[1]->fill_chroma(0x80);
+        if (_jit_ready)
+            _jit_ring.fill_chroma(0x80);
+        _chroma_filled = true;
+    }
+
+    picture_coding_type = type;
     switch (picture_coding_type) {
         case I_FRAME:
         case P_FRAME:
             //printf("%s:%d\n",picture_coding_type == I_FRAME ? "I_FRAME":"P_FRAME",temporal_reference);
+            STATS(_mb_stats.type = picture_coding_type);
+            _current_type = picture_coding_type;
+            _refs++;
+            break;
+        case B_FRAME:
+            if (!MPEG_B_PICTURES) {
+                picture_coding_type = 0;    // no heap for them
+                _bframe_skipped++;
+                return;
+            }
+            if (_refs < 2) {
+                picture_coding_type = 0;    // leading B pictures refer to a picture before the reset
+                return;
+            }
+            if (_pts < _seek_pts) {
+                picture_coding_type = 0;    // nothing refers to it, not even decoded
+                _seek_dropped++;
+                return;
+            }
+            _backward = _current;           // decoded but not shown yet
+            _bframe_pts = _pts;
             break;
         default:
-            return; // Ignore B or D frames
+            picture_coding_type = 0;        // ignore D frames
+            return;
     }
     get_bits(16);   // vbv_delay
 
-    if (picture_coding_type == P_FRAME) {
+    if (picture_coding_type != I_FRAME) {
         full_pel_forward = get_bit();
         forward_r_size = get_bits(3)-1;
     }
+    if (picture_coding_type == B_FRAME) {
+        full_pel_backward = get_bit();
+        backward_r_size = get_bits(3)-1;
+    }
 }
 
 void MpegDecoder::reset_predictors()
 {
     y_dc = cr_dc = cb_dc = 128; // reset DC prediction
     forward_motion_h = forward_motion_v = 0;    // reset motion vectors
+    backward_motion_h = backward_motion_v = 0;
 }
 
-uint32_t _src_align[5*17];
-void MpegDecoder::mocomp(uint8_t* dst, int pos_x, int pos_y, int size, int c)
-{
-    int xy = ((pos_y & 1) << 1) | (pos_x & 1);
-    pos_y >>= 1;
-    pos_x >>= 1;
+// Motion compensation kernels, one per block size, half pel case and source alignment.
+// Reference frames are only 32 bit addressable: read words, funnel shift them into alignment and
+// average four pixels at a time. Rounding matches (a+b+1)>>1 and (a+b+c+d+2)>>2 exactly.
+// AVG kernels average into the forward prediction already in the destination for B pictures.
 
-    // copy reference block into a 8 bit addressable buffer
-    uint32_t* d32 = _src_align;
-    for (int y = 0; y < (size + (xy >> 1)); y++) {
-        const uint8_t* src_line;
-        switch (c) {
-            case 1: src_line = _reference->get_cr(pos_y); break;
-            case 2: src_line = _reference->get_cb(pos_y); break;
-            default: src_line = _reference->get_y(pos_y);
-        }
-        src_line += pos_x & ~3;
-        const uint32_t *s32  = (const uint32_t*)(src_line);
-        d32[0] = s32[0];
-        d32[1] = s32[1];
-        d32[2] = s32[2];
-        if (size == 16) {
-            d32[3] = s32[3];
-            d32[4] = s32[4];
-        }
-        pos_y++;
-        d32 += 5;
-    }
+typedef uint8_t* (Frame::*FrameRow)(int y);
+typedef void (*MocompKernel)(uint32_t* d32, Frame* ref, FrameRow row, int x, int y);
 
-    // src is copied into 8 bit mem. do the mocomp
-    const uint8_t* src = ((uint8_t*)_src_align) + (pos_x & 3);
-    const uint8_t* src2;
-    int dst_stride = FB_STRIDE >> 2;
-    d32 = (uint32_t*)(dst + size*mb_x);
+// 4 pixels starting at byte A of s
+template <int A> inline uint32_t word_at(const uint32_t* s)
+{
+    return (s[0] >> (A*8)) | (s[1] << (32 - A*8));
+}
 
-    switch (xy)
-    {
-        case 0:
-            for (int y = 0; y < size; y++) {
-                for (int x = 0; x < size/4; x++)
-                    d32[x] = ((uint32_t*)src)[x];
-                src += 5*4;
-                d32 += dst_stride;
-            }
-            break;
-        case 1:
-            for (int y = 0; y < size; y++) {
-                int b = src[0];
-                int a;
-                for (int x = 0; x < size; x += 4) {
-                    uint32_t p = (b + (a=src[x+1]) + 1) >> 1;
-                    p |= ((a + (b=src[x+2]) + 1) >> 1) << 8;
-                    p |= ((b + (a=src[x+3]) + 1) >> 1) << 16;
-                    p |= ((a + (b=src[x+4]) + 1) >> 1) << 24;
-                    d32[x>>2] = p;
-                }
-                src += 5*4;
-                d32 += dst_stride;
-            }
-            break;
-        case 2:
-            for (int y = 0; y < size; y++) {
-                src2 = src + 5*4;
-                for (int x = 0; x < size; x += 4) {
-                    d32[x>>2] =
-                    (((src[x+0] + src2[x+0] + 1) >> 1) << 0) |
-                    (((src[x+1] + src2[x+1] + 1) >> 1) << 8) |
-                    (((src[x+2] + src2[x+2] + 1) >> 1) << 16) |
-                    (((src[x+3] + src2[x+3] + 1) >> 1) << 24);
-                }
-                src += 5*4;
-                d32 += dst_stride;
-            }
-            break;
-        case 3:
-            for (int y = 0; y < size; y++) {
-                src2 = src + 5*4;
-                for (int x = 0; x < size; x += 4) { // see case 1 above
-                    d32[x>>2] =
-                    (((src[x+0] + src[x+1] + src2[x+0] + src2[x+1] + 2) >> 2) << 0) |
-                    (((src[x+1] + src[x+2] + src2[x+1] + src2[x+2] + 2) >> 2) << 8) |
-                    (((src[x+2] + src[x+3] + src2[x+2] + src2[x+3] + 2) >> 2) << 16) |
-                    (((src[x+3] + src[x+4] + src2[x+3] + src2[x+4] + 2) >> 2) << 24);
-                }
-                src += 5*4;
-                d32 += dst_stride;
-            }
-            break;
-    }
+template <> inline uint32_t word_at<0>(const uint32_t* s)
+{
+    return s[0];
 }
 
-void MpegDecoder::inc_mb(int n )
+inline uint32_t avg2(uint32_t a, uint32_t b)
 {
-    mb_x += 1;
-    while (mb_x >= mb_width) {
-        mb_x -= mb_width;
-        mb_y++;
-        y_addr = _current->get_y(mb_y << 4);
-        cr_addr = y_addr + FB_WIDTH;
-        cb_addr = cr_addr + FB_STRIDE*8;
-    }
+    return (a | b) - (((a ^ b) >> 1) & 0x7F7F7F7F);
 }
 
-inline
-void MpegDecoder::blit(uint8_t* dst, uint8_t* src, int size)
+inline uint32_t avg4(uint32_t a, uint32_t b, uint32_t c, uint32_t d)
 {
-    int x = mb_x*size;
-    uint32_t* s32 = (uint32_t*)(src+x);
-    uint32_t* d32 = (uint32_t*)(dst+x);
-    int stride = FB_STRIDE >> 2;
-    if (size == 8) {
-        for (int i = 0; i < size; i++) {
-            d32[0] = s32[0];
-            d32[1] = s32[1];
-            d32 += stride;
-            s32 += stride;
-        }
-    } else {
-        for (int i = 0; i < size; i++) {
-            d32[0] = s32[0];
-            d32[1] = s32[1];
-            d32[2] = s32[2];
-            d32[3] = s32[3];
-            d32 += stride;
-            s32 += stride;
+    uint32_t lo = (a & 0x03030303) + (b & 0x03030303) + (c & 0x03030303) + (d & 0x03030303) + 0x02020202;
+    uint32_t hi = ((a >> 2) & 0x3F3F3F3F) + ((b >> 2) & 0x3F3F3F3F) + ((c >> 2) & 0x3F3F3F3F) + ((d >> 2) & 0x3F3F3F3F);
+    return hi + ((lo >> 2) & 0x03030303);
+}
+
+// x is in words, A is the byte within the word
+template <int SIZE, int XY, int A, bool AVG>
+static void mocomp_kernel(uint32_t* d32, Frame* ref, FrameRow row, int x, int y)
+{
+    const int B = (A + 1) & 3;  // the pixel to the right
+    const int N = (A + 1) >> 2; // is in the next word
+    const uint32_t* s = (const uint32_t*)(ref->*row)(y) + x;
+    for (int j = 1; j <= SIZE; j++) {
+        const uint32_t* s2 = s;
+        if (XY & 2)
+            s2 = (const uint32_t*)(ref->*row)(y + j) + x;
+        for (int i = 0; i < SIZE/4; i++) {
+            uint32_t p = word_at<A>(s + i);
+            switch (XY) {
+                case 1: p = avg2(p,word_at<B>(s + i + N)); break;
+                case 2: p = avg2(p,word_at<A>(s2 + i)); break;
+                case 3: p = avg4(p,word_at<B>(s + i + N),word_at<A>(s2 + i),word_at<B>(s2 + i + N)); break;
+            }
+            d32[i] = AVG ? avg2(d32[i],p) : p;
         }
+        if (XY & 2)
+            s = s2;
+        else if (j < SIZE)
+            s = (const uint32_t*)(ref->*row)(y + j) + x;
+        d32 += FB_STRIDE >> 2;
     }
 }
 
-void MpegDecoder::predict_zero()
+#define MOCOMP_ALIGN(_s,_xy,_a) { mocomp_kernel<_s,_xy,0,_a>, mocomp_kernel<_s,_xy,1,_a>, mocomp_kernel<_s,_xy,2,_a>, mocomp_kernel<_s,_xy,3,_a> }
+#define MOCOMP_SIZE(_s,_a) { MOCOMP_ALIGN(_s,0,_a), MOCOMP_ALIGN(_s,1,_a), MOCOMP_ALIGN(_s,2,_a), MOCOMP_ALIGN(_s,3,_a) }
+
+static const MocompKernel _mocomp_kernels[2][2][4][4] = {   // [avg][size]
+    { MOCOMP_SIZE(16,false), MOCOMP_SIZE(8,false) },
+    { MOCOMP_SIZE(16,true), MOCOMP_SIZE(8,true) }
+};
+
+//========================================================================================
+//========================================================================================
+// Host SIMD kernels, picked at runtime from what the cpu supports.
+// The scalar kernels above stay the reference, set_simd(SIMD_NONE) forces them.
+// Everything here is bit exact with them, bench -c golden.txt checks each level.
+
+#ifdef PIXEL_SIMD
+
+#define SSE2_FN __attribute__((target("sse2")))
+#define AVX2_FN __attribute__((target("avx2")))
+
+static int simd_detect()
 {
-    uint8_t* ref = _reference->get_y(mb_y << 4);
-    blit(y_addr,ref);
-    blit(cr_addr,ref + FB_WIDTH,8);
-    blit(cb_addr,ref + FB_WIDTH + FB_STRIDE*8,8);
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse2"))
+        return SIMD_SSE2;
+    return SIMD_NONE;
 }
 
+static int _simd = simd_detect();
+
+// 8 point transform on each lane, same arithmetic as the scalar columns and rows
+#define IDCT8(_v) { \
+    auto b1 = _v[4]; \
+    auto b3 = _v[2] + _v[6]; \
+    auto b4 = _v[5] - _v[3]; \
+    auto tmp1 = _v[1] + _v[7]; \
+    auto tmp2 = _v[3] + _v[5]; \
+    auto b6 = _v[1] - _v[7]; \
+    auto b7 = tmp1 + tmp2; \
+    auto m0 = _v[0]; \
+    auto x4 = ((b6*473 - b4*196 + 128) >> 8) - b7; \
+    auto x0 = x4 - (((tmp1 - tmp2)*362 + 128) >> 8); \
+    auto x1 = m0 - b1; \
+    auto x2 = (((_v[2] - _v[6])*362 + 128) >> 8) - b3; \
+    auto x3 = m0 + b1; \
+    auto y3 = x1 + x2; \
+    auto y4 = x3 + b3; \
+    auto y5 = x1 - x2; \
+    auto y6 = x3 - b3; \
+    auto y7 = -x0 - ((b4*473 + b6*196 + 128) >> 8); \
+    _v[0] = b7 + y4; \
+    _v[1] = x4 + y3; \
+    _v[2] = y5 - x0; \
+    _v[3] = y6 - y7; \
+    _v[4] = y6 + y7; \
+    _v[5] = x0 + y5; \
+    _v[6] = y3 - x4; \
+    _v[7] = y4 - b7; \
+}
 
-void MpegDecoder::predict()
+// 4 x int32
+struct V4 {
+    __m128i v;
+};
+SSE2_FN inline V4 operator+(V4 a, V4 b) { return {_mm_add_epi32(a.v,b.v)}; }
+SSE2_FN inline V4 operator-(V4 a, V4 b) { return {_mm_sub_epi32(a.v,b.v)}; }
+SSE2_FN inline V4 operator-(V4 a) { return {_mm_sub_epi32(_mm_setzero_si128(),a.v)}; }
+SSE2_FN inline V4 operator+(V4 a, int b) { return {_mm_add_epi32(a.v,_mm_set1_epi32(b))}; }
+SSE2_FN inline V4 operator>>(V4 a, int n) { return {_mm_srai_epi32(a.v,n)}; }
+SSE2_FN inline V4 operator*(V4 a, int k)   // low 32 bits of the products, sse2 has no pmulld
 {
-    int h = forward_motion_h;
-    int v = forward_motion_v;
-    if (h == 0 && v == 0) {
-        predict_zero();
-        return;
-    }
-    if (full_pel_forward) {
-        h <<= 1;
-        v <<= 1;
-    }
-    int x = (mb_x << 5) + h;
-    int y = (mb_y << 5) + v;
-    mocomp(y_addr,x,y,16);
-    x >>= 1;
-    y >>= 1;
-    mocomp(cr_addr,x,y,8,1);
-    mocomp(cb_addr,x,y,8,2);
+    __m128i c = _mm_set1_epi32(k);
+    __m128i e = _mm_mul_epu32(a.v,c);
+    __m128i o = _mm_mul_epu32(_mm_srli_si128(a.v,4),c);
+    return {_mm_unpacklo_epi32(_mm_shuffle_epi32(e,_MM_SHUFFLE(0,0,2,0)),_mm_shuffle_epi32(o,_MM_SHUFFLE(0,0,2,0)))};
 }
 
-int MpegDecoder::motion_vector(int m, int r_size)
+SSE2_FN inline void transpose4(V4& a, V4& b, V4& c, V4& d)
 {
-    int d;
-    int scale = 1 << r_size;
-    int code = get_vlc(motion_vec);
-    if ((code != 0) && (scale != 1))
+    __m128i t0 = _mm_unpacklo_epi32(a.v,b.v);
+    __m128i t1 = _mm_unpacklo_epi32(c.v,d.v);
+    __m128i t2 = _mm_unpackhi_epi32(a.v,b.v);
+    __m128i t3 = _mm_unpackhi_epi32(c.v,d.v);
+    a.v = _mm_unpacklo_epi64(t0,t1);
+    b.v = _mm_unpackhi_epi64(t0,t1);
+    c.v = _mm_unpacklo_epi64(t2,t3);
+    d.v = _mm_unpackhi_epi64(t2,t3);
+}
+
+// 8x8 as [row][half], transposed in 4x4 quarters
+SSE2_FN inline void transpose8(V4 (*m)[2])
+{
+    transpose4(m[0][0],m[1][0],m[2][0],m[3][0]);
+    transpose4(m[4][1],m[5][1],m[6][1],m[7][1]);
+    transpose4(m[0][1],m[1][1],m[2][1],m[3][1]);
+    transpose4(m[4][0],m[5][0],m[6][0],m[7][0]);
+    for (int i = 0; i < 4; i++) {
+        V4 t = m[i][1];
+        m[i][1] = m[i+4][0];
+        m[i+4][0] = t;
+    }
+}
+
+SSE2_FN static void idct_sse2(const int* b, int* d)
+{
+    V4 m[8][2];
+    for (int i = 0; i < 8; i++) {
+        m[i][0].v = _mm_loadu_si128((const __m128i*)(b + i*8));
+        m[i][1].v = _mm_loadu_si128((const __m128i*)(b + i*8 + 4));
+    }
+    for (int h = 0; h < 2; h++) {   // columns
+        V4 v[8];
+        for (int i = 0; i < 8; i++) v[i] = m[i][h];
+        IDCT8(v);
+        for (int i = 0; i < 8; i++) m[i][h] = v[i];
+    }
+    transpose8(m);
+    for (int h = 0; h < 2; h++) {   // rows
+        V4 v[8];
+        for (int i = 0; i < 8; i++) v[i] = m[i][h];
+        IDCT8(v);
+        for (int i = 0; i < 8; i++) m[i][h] = (v[i] + 128) >> 8;
+    }
+    transpose8(m);
+    for (int i = 0; i < 8; i++) {
+        _mm_storeu_si128((__m128i*)(d + i*8),m[i][0].v);
+        _mm_storeu_si128((__m128i*)(d + i*8 + 4),m[i][1].v);
+    }
+}
+
+// 8 x int32
+struct V8 {
+    __m256i v;
+};
+AVX2_FN inline V8 operator+(V8 a, V8 b) { return {_mm256_add_epi32(a.v,b.v)}; }
+AVX2_FN inline V8 operator-(V8 a, V8 b) { return {_mm256_sub_epi32(a.v,b.v)}; }
+AVX2_FN inline V8 operator-(V8 a) { return {_mm256_sub_epi32(_mm256_setzero_si256(),a.v)}; }
+AVX2_FN inline V8 operator+(V8 a, int b) { return {_mm256_add_epi32(a.v,_mm256_set1_epi32(b))}; }
+AVX2_FN inline V8 operator>>(V8 a, int n) { return {_mm256_srai_epi32(a.v,n)}; }
+AVX2_FN inline V8 operator*(V8 a, int k) { return {_mm256_mullo_epi32(a.v,_mm256_set1_epi32(k))}; }
+
+AVX2_FN inline void transpose8(V8* m)
+{
+    __m256i t[8],u[8];
+    for (int i = 0; i < 8; i += 2) {
+        t[i] = _mm256_unpacklo_epi32(m[i].v,m[i+1].v);
+        t[i+1] = _mm256_unpackhi_epi32(m[i].v,m[i+1].v);
+    }
+    for (int i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i],t[i+2]);
+        u[i+1] = _mm256_unpackhi_epi64(t[i],t[i+2]);
+        u[i+2] = _mm256_unpacklo_epi64(t[i+1],t[i+3]);
+        u[i+3] = _mm256_unpackhi_epi64(t[i+1],t[i+3]);
+    }
+    for (int i = 0; i < 4; i++) {
+        m[i].v = _mm256_permute2x128_si256(u[i],u[i+4],0x20);
+        m[i+4].v = _mm256_permute2x128_si256(u[i],u[i+4],0x31);
+    }
+}
+
+AVX2_FN static void idct_avx2(const int* b, int* d)
+{
+    V8 v[8];
+    for (int i = 0; i < 8; i++)
+        v[i].v = _mm256_loadu_si256((const __m256i*)(b + i*8));
+    IDCT8(v);       // columns
+    transpose8(v);
+    IDCT8(v);       // rows
+    for (int i = 0; i < 8; i++)
+        v[i] = (v[i] + 128) >> 8;
+    transpose8(v);
+    for (int i = 0; i < 8; i++)
+        _mm256_storeu_si256((__m256i*)(d + i*8),v[i].v);
+}
+
+// (a+b+c+d+2)>>2 of 16 pixels
+SSE2_FN inline __m128i avg4_sse2(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+    const __m128i z = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a,z),_mm_unpacklo_epi8(b,z)),
+                               _mm_add_epi16(_mm_unpacklo_epi8(c,z),_mm_unpacklo_epi8(d,z)));
+    __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a,z),_mm_unpackhi_epi8(b,z)),
+                               _mm_add_epi16(_mm_unpackhi_epi8(c,z),_mm_unpackhi_epi8(d,z)));
+    lo = _mm_srli_epi16(_mm_add_epi16(lo,two),2);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi,two),2);
+    return _mm_packus_epi16(lo,hi);
+}
+
+SSE2_FN inline __m128i load_sse2(const uint8_t* s, int size)
+{
+    return size == 16 ? _mm_loadu_si128((const __m128i*)s) : _mm_loadl_epi64((const __m128i*)s);
+}
+
+SSE2_FN inline void store_sse2(uint8_t* d, __m128i p, int size)
+{
+    if (size == 16)
+        _mm_storeu_si128((__m128i*)d,p);
+    else
+        _mm_storel_epi64((__m128i*)d,p);
+}
+
+// unaligned loads make the source alignment irrelevant, x is in pixels
+typedef void (*MocompSIMD)(uint8_t* d, Frame* ref, FrameRow row, int x, int y);
+
+template <int SIZE, int XY, bool AVG>
+SSE2_FN static void mocomp_sse2(uint8_t* d, Frame* ref, FrameRow row, int x, int y)
+{
+    const uint8_t* s = (ref->*row)(y) + x;
+    for (int j = 1; j <= SIZE; j++) {
+        const uint8_t* s2 = (XY & 2) ? (ref->*row)(y + j) + x : s;
+        __m128i p = load_sse2(s,SIZE);
+        switch (XY) {
+            case 1: p = _mm_avg_epu8(p,load_sse2(s + 1,SIZE)); break;
+            case 2: p = _mm_avg_epu8(p,load_sse2(s2,SIZE)); break;
+            case 3: p = avg4_sse2(p,load_sse2(s + 1,SIZE),load_sse2(s2,SIZE),load_sse2(s2 + 1,SIZE)); break;
+        }
+        if (AVG)
+            p = _mm_avg_epu8(p,load_sse2(d,SIZE));
+        store_sse2(d,p,SIZE);
+        if (XY & 2)
+            s = s2;
+        else if (j < SIZE)
+            s = (ref->*row)(y + j) + x;
+        d += FB_STRIDE;
+    }
+}
+
+// 16 wide four way average, widened to 16 bits in one register
+template <bool AVG>
+AVX2_FN static void mocomp_avx2_16_3(uint8_t* d, Frame* ref, FrameRow row, int x, int y)
+{
+    const __m256i two = _mm256_set1_epi16(2);
+    const uint8_t* s = (ref->*row)(y) + x;
+    __m256i a = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)s)),
+                                 _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + 1))));
+    for (int j = 1; j <= 16; j++) {
+        s = (ref->*row)(y + j) + x;
+        __m256i b = _mm256_add_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)s)),
+                                     _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + 1))));
+        __m256i p = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(a,b),two),2);
+        p = _mm256_packus_epi16(p,_mm256_permute2x128_si256(p,p,0x01));
+        __m128i q = _mm256_castsi256_si128(p);
+        if (AVG)
+            q = _mm_avg_epu8(q,_mm_loadu_si128((const __m128i*)d));
+        _mm_storeu_si128((__m128i*)d,q);
+        a = b;      // bottom pair is the next row's top
+        d += FB_STRIDE;
+    }
+}
+
+#define MOCOMP_SSE2(_s,_a) { mocomp_sse2<_s,0,_a>, mocomp_sse2<_s,1,_a>, mocomp_sse2<_s,2,_a>, mocomp_sse2<_s,3,_a> }
+#define MOCOMP_AVX2(_a) { mocomp_sse2<16,0,_a>, mocomp_sse2<16,1,_a>, mocomp_sse2<16,2,_a>, mocomp_avx2_16_3<_a> }
+
+static const MocompSIMD _mocomp_sse2[2][2][4] = {   // [avg][size]
+    { MOCOMP_SSE2(16,false), MOCOMP_SSE2(8,false) },
+    { MOCOMP_SSE2(16,true), MOCOMP_SSE2(8,true) }
+};
+
+static const MocompSIMD _mocomp_avx2[2][2][4] = {
+    { MOCOMP_AVX2(false), MOCOMP_SSE2(8,false) },
+    { MOCOMP_AVX2(true), MOCOMP_SSE2(8,true) }
+};
+
+// PIN of 8 rows of 8
+SSE2_FN static void copy_block_sse2(uint8_t* dst, const int* b)
+{
+    const __m128i lim = _mm_set1_epi8((char)248);
+    for (int i = 0; i < 8; i++) {
+        __m128i r = _mm_packs_epi32(_mm_loadu_si128((__m128i*)b),_mm_loadu_si128((__m128i*)(b+4)));
+        r = _mm_packus_epi16(r,r);
+        _mm_storel_epi64((__m128i*)dst,_mm_min_epu8(r,lim));
+        dst += FB_STRIDE;
+        b += 8;
+    }
+}
+
+SSE2_FN static void add_block_sse2(uint8_t* dst, const int* b)
+{
+    const __m128i lim = _mm_set1_epi8((char)248);
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < 8; i++) {
+        __m128i r = _mm_packs_epi32(_mm_loadu_si128((__m128i*)b),_mm_loadu_si128((__m128i*)(b+4)));
+        __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((__m128i*)dst),zero);
+        p = _mm_adds_epi16(p,r);
+        p = _mm_packus_epi16(p,p);
+        _mm_storel_epi64((__m128i*)dst,_mm_min_epu8(p,lim));
+        dst += FB_STRIDE;
+        b += 8;
+    }
+}
+
+int set_simd(int level)
+{
+    _simd = min(max(level,0),simd_detect());
+    return _simd;
+}
+
+#else
+static const int _simd = SIMD_NONE;
+int set_simd(int level)
+{
+    return SIMD_NONE;
+}
+#endif
+
+int simd_level()
+{
+    return _simd;
+}
+
+void MBRender::mocomp(uint8_t* dst, Frame* ref, int pos_x, int pos_y, int size, int c, bool avg)
+{
+    MEASURE(_predict_ticks);
+    int xy = ((pos_y & 1) << 1) | (pos_x & 1);
+    pos_y >>= 1;
+    pos_x >>= 1;
+
+    FrameRow row;
+    switch (c) {
+        case 1: row = &Frame::get_cr; break;
+        case 2: row = &Frame::get_cb; break;
+        default: row = &Frame::get_y;
+    }
+#ifdef PIXEL_SIMD
+    if (_simd) {
+        const MocompSIMD* k = _simd == SIMD_AVX2 ? _mocomp_avx2[avg][size == 16 ? 0 : 1] : _mocomp_sse2[avg][size == 16 ? 0 : 1];
+        k[xy](dst + size*mb_x,ref,row,pos_x,pos_y);
+        return;
+    }
+#endif
+    uint32_t* d32 = (uint32_t*)(dst + size*mb_x);
+    _mocomp_kernels[avg][size == 16 ? 0 : 1][xy][pos_x & 3](d32,ref,row,pos_x >> 2,pos_y);
+}
+
+void MpegDecoder::inc_mb(int n )
+{
+    mb_x += n;
+    while (mb_x >= mb_width) {
+        mb_x -= mb_width;
+        mb_y++;
+        if (_releasing)
+            wait_released(mb_y);
+    }
+}
+
+// wait for the beam to leave strip y of the frame push_video replaced, stage two draws behind us.
+// Called under MEASURE(_picture_ticks), the time blocked is moved to _release_ticks.
+void MpegDecoder::wait_released(int y)
+{
+    y = min(y,FB_SLICES-1);
+    if (video_strip() - (_released + y) <= 0) {
+        _release_waits++;
+#ifdef MPEG_PROFILE
+        uint32_t t = cpu_ticks();
+        video_wait_strip(_released + y);
+        t = cpu_ticks() - t;
+        _release_ticks += t;
+        _picture_ticks -= t;        // blocked, not decoding
+#else
+        video_wait_strip(_released + y);
+#endif
+    }
+    if (y == FB_SLICES-1)
+        _releasing = false;
+}
+
+inline
+void MBRender::blit(uint8_t* dst, uint8_t* src, int size)
+{
+    int x = mb_x*size;
+    uint32_t* s32 = (uint32_t*)(src+x);
+    uint32_t* d32 = (uint32_t*)(dst+x);
+    int stride = FB_STRIDE >> 2;
+    if (size == 8) {
+        for (int i = 0; i < size; i++) {
+            d32[0] = s32[0];
+            d32[1] = s32[1];
+            d32 += stride;
+            s32 += stride;
+        }
+    } else {
+        for (int i = 0; i < size; i++) {
+            d32[0] = s32[0];
+            d32[1] = s32[1];
+            d32[2] = s32[2];
+            d32[3] = s32[3];
+            d32 += stride;
+            s32 += stride;
+        }
+    }
+}
+
+void MBRender::predict_zero(Frame* f)
+{
+    MEASURE(_predict_ticks);
+    f = ref_view(f,mb_y << 5);
+    uint8_t* ref = f->get_y(mb_y << 4);
+    blit(y_addr,ref);
+    if (_luma_only)
+        return;
+    blit(cr_addr,ref + FB_WIDTH,8);
+    blit(cb_addr,ref + FB_WIDTH + FB_STRIDE*8,8);
+}
+
+
+// avg averages with the forward prediction already in place
+void MBRender::predict(Frame* ref, int h, int v, bool avg)
+{
+    if (h == 0 && v == 0 && !avg) {
+        predict_zero(ref);
+        return;
+    }
+    int x = (mb_x << 5) + h;
+    int y = (mb_y << 5) + v;
+    x = max(0,min(x,(min(mb_width,FB_WIDTH >> 4)-1) << 5));    // stay inside the reference on bad streams
+    y = max(0,min(y,(FB_HEIGHT-16) << 1));
+    ref = ref_view(ref,y);
+    mocomp(y_addr,ref,x,y,16,0,avg);
+    if (_luma_only)
+        return;
+    x >>= 1;
+    y >>= 1;
+    mocomp(cr_addr,ref,x,y,8,1,avg);
+    mocomp(cb_addr,ref,x,y,8,2,avg);
+}
+
+int MpegDecoder::motion_vector(int m, int r_size)
+{
+    int d;
+    int scale = 1 << r_size;
+    int code = get_vlc(_motion_vlc);
+    if ((code != 0) && (scale != 1))
     {
         d = ((abs(code) - 1) << r_size) + get_bits(r_size) + 1;
         if (code < 0)
@@ -904,36 +1751,193 @@ int MpegDecoder::motion_vector(int m, int r_size)
     m += d;
     if (m > (scale << 4) - 1)
         m -= scale << 5;
-    else if (m < ((-scale) << 4))
+    else if (m < -(scale << 4))
         m += scale << 5;
     return m;
 }
 
-void MpegDecoder::motion_vectors(bool fw)
+// P pictures reset the forward vector when it is not coded, B pictures keep both until a slice or intra
+void MpegDecoder::motion_vectors(int mb_type)
 {
-    if (!fw) {
+    if (mb_type & 0x08) {
+        forward_motion_h = motion_vector(forward_motion_h,forward_r_size);
+        forward_motion_v = motion_vector(forward_motion_v,forward_r_size);
+    } else if (picture_coding_type == P_FRAME)
         forward_motion_h = forward_motion_v = 0;    // reset motion vectors
-        return;
+    if (mb_type & 0x04) {
+        backward_motion_h = motion_vector(backward_motion_h,backward_r_size);
+        backward_motion_v = motion_vector(backward_motion_v,backward_r_size);
     }
-    forward_motion_h = motion_vector(forward_motion_h,forward_r_size);
-    forward_motion_v = motion_vector(forward_motion_v,forward_r_size);
 }
 
-void MpegDecoder::idct(int* b, int n)
+// prediction of an inter macroblock from the current vectors
+void MpegDecoder::inter_cmd(MBCmd* cmd, int dir)
 {
-   // MEASURE(_idct_ticks);
-    if (n == 1) {   // DC only block
-        int dc = b[0] >> 8;
-        for (int i = 0; i < 64; i++)
-            b[i] = dc;
-        return;
+    cmd->dir = dir;
+    cmd->motion_h = forward_motion_h*(1 << full_pel_forward);
+    cmd->motion_v = forward_motion_v*(1 << full_pel_forward);
+    cmd->back_h = backward_motion_h*(1 << full_pel_backward);
+    cmd->back_v = backward_motion_v*(1 << full_pel_backward);
+#ifdef MPEG_STATS
+    int h = (dir & MB_FORWARD) ? cmd->motion_h : cmd->back_h;
+    int v = (dir & MB_FORWARD) ? cmd->motion_v : cmd->back_v;
+    _mb_stats.half_pel[((v & 1) << 1) | (h & 1)]++;
+    _mb_stats.mv_min[0] = min(_mb_stats.mv_min[0],h);
+    _mb_stats.mv_max[0] = max(_mb_stats.mv_max[0],h);
+    _mb_stats.mv_min[1] = min(_mb_stats.mv_min[1],v);
+    _mb_stats.mv_max[1] = max(_mb_stats.mv_max[1],v);
+#endif
+    if (_degrade >= DEGRADE_FULL_PEL || _reduced) {
+        cmd->motion_h &= ~1;
+        cmd->motion_v &= ~1;
+        cmd->back_h &= ~1;
+        cmd->back_v &= ~1;
     }
+}
 
-    // See http://vsr.informatik.tu-chemnitz.de/~jan/MPEG/HTML/IDCT.html
+// See http://vsr.informatik.tu-chemnitz.de/~jan/MPEG/HTML/IDCT.html
+// Coefficients are sparse so the transform is pruned to the footprint of the block.
+// rows and cols are bitmasks of rows/columns holding coefficients.
+// Zero inputs are dropped from the full transform so every path is bit-exact with it.
+void MBRender::idct(const int* b, int* d, int rows, int cols)
+{
+    MEASURE(_idct_ticks);
     int b1, b3, b4, b6, b7, tmp1, tmp2, m0;
     int x0, x1, x2, x3, x4, y3, y4, y5, y6, y7;
     int i;
 
+    if (rows == 1) {
+        // first row only: column pass is a copy, transform one row and replicate
+        b1 =  b[4];
+        b3 =  b[2] + b[6];
+        b4 =  b[5] - b[3];
+        tmp1 = b[1] + b[7];
+        tmp2 = b[3] + b[5];
+        b6 = b[1] - b[7];
+        b7 = tmp1 + tmp2;
+        m0 =  b[0];
+        x4 =  ((b6*473 - b4*196 + 128) >> 8) - b7;
+        x0 =  x4 - (((tmp1 - tmp2)*362 + 128) >> 8);
+        x1 =  m0 - b1;
+        x2 =  (((b[2] - b[6])*362 + 128) >> 8) - b3;
+        x3 =  m0 + b1;
+        y3 =  x1 + x2;
+        y4 =  x3 + b3;
+        y5 =  x1 - x2;
+        y6 =  x3 - b3;
+        y7 = -x0 - ((b4*473 + b6*196 + 128) >> 8);
+        d[0] =  (b7 + y4 + 128) >> 8;
+        d[1] =  (x4 + y3 + 128) >> 8;
+        d[2] =  (y5 - x0 + 128) >> 8;
+        d[3] =  (y6 - y7 + 128) >> 8;
+        d[4] =  (y6 + y7 + 128) >> 8;
+        d[5] =  (x0 + y5 + 128) >> 8;
+        d[6] =  (y3 - x4 + 128) >> 8;
+        d[7] =  (y4 - b7 + 128) >> 8;
+        for (i = 8; i < 64; i++)
+            d[i] = d[i-8];
+        return;
+    }
+
+    if (cols == 1) {
+        // first column only: transform one column, each row pass is then flat
+        b1 =  b[4*8];
+        b3 =  b[2*8] + b[6*8];
+        b4 =  b[5*8] - b[3*8];
+        tmp1 = b[1*8] + b[7*8];
+        tmp2 = b[3*8] + b[5*8];
+        b6 = b[1*8] - b[7*8];
+        b7 = tmp1 + tmp2;
+        m0 =  b[0];
+        x4 =  ((b6*473 - b4*196 + 128) >> 8) - b7;
+        x0 =  x4 - (((tmp1 - tmp2)*362 + 128) >> 8);
+        x1 =  m0 - b1;
+        x2 =  (((b[2*8] - b[6*8])*362 + 128) >> 8) - b3;
+        x3 =  m0 + b1;
+        y3 =  x1 + x2;
+        y4 =  x3 + b3;
+        y5 =  x1 - x2;
+        y6 =  x3 - b3;
+        y7 = -x0 - ((b4*473 + b6*196 + 128) >> 8);
+        int c[8] = {
+            b7 + y4, x4 + y3, y5 - x0, y6 - y7,
+            y6 + y7, x0 + y5, y3 - x4, y4 - b7
+        };
+        for (i = 0; i < 8; i++) {
+            int v = (c[i] + 128) >> 8;
+            int* r = d + i*8;
+            r[0] = r[1] = r[2] = r[3] = r[4] = r[5] = r[6] = r[7] = v;
+        }
+        return;
+    }
+
+    if (((rows | cols) & 0xF0) == 0) {
+        // top left 4x4: rows and columns 4-7 of the input are zero
+        for (i = 0; i < 4; ++i) {
+            b3 =  b[2*8+i];
+            b4 = -b[3*8+i];
+            tmp1 = b[1*8+i];
+            tmp2 = b[3*8+i];
+            b6 = tmp1;
+            b7 = tmp1 + tmp2;
+            m0 =  b[0*8+i];
+            x4 =  ((b6*473 - b4*196 + 128) >> 8) - b7;
+            x0 =  x4 - (((tmp1 - tmp2)*362 + 128) >> 8);
+            x2 =  ((b3*362 + 128) >> 8) - b3;
+            y3 =  m0 + x2;
+            y4 =  m0 + b3;
+            y5 =  m0 - x2;
+            y6 =  m0 - b3;
+            y7 = -x0 - ((b4*473 + b6*196 + 128) >> 8);
+            d[0*8+i] =  b7 + y4;
+            d[1*8+i] =  x4 + y3;
+            d[2*8+i] =  y5 - x0;
+            d[3*8+i] =  y6 - y7;
+            d[4*8+i] =  y6 + y7;
+            d[5*8+i] =  x0 + y5;
+            d[6*8+i] =  y3 - x4;
+            d[7*8+i] =  y4 - b7;
+        }
+        for (i = 0; i < 64; i += 8) {
+            b3 =  d[2+i];
+            b4 = -d[3+i];
+            tmp1 = d[1+i];
+            tmp2 = d[3+i];
+            b6 = tmp1;
+            b7 = tmp1 + tmp2;
+            m0 =  d[0+i];
+            x4 =  ((b6*473 - b4*196 + 128) >> 8) - b7;
+            x0 =  x4 - (((tmp1 - tmp2)*362 + 128) >> 8);
+            x2 =  ((b3*362 + 128) >> 8) - b3;
+            y3 =  m0 + x2;
+            y4 =  m0 + b3;
+            y5 =  m0 - x2;
+            y6 =  m0 - b3;
+            y7 = -x0 - ((b4*473 + b6*196 + 128) >> 8);
+            d[0+i] =  (b7 + y4 + 128) >> 8;
+            d[1+i] =  (x4 + y3 + 128) >> 8;
+            d[2+i] =  (y5 - x0 + 128) >> 8;
+            d[3+i] =  (y6 - y7 + 128) >> 8;
+            d[4+i] =  (y6 + y7 + 128) >> 8;
+            d[5+i] =  (x0 + y5 + 128) >> 8;
+            d[6+i] =  (y3 - x4 + 128) >> 8;
+            d[7+i] =  (y4 - b7 + 128) >> 8;
+        }
+        return;
+    }
+
+#ifdef PIXEL_SIMD
+    // after the pruned cases, the scalar 4x4 beats a full SSE2/AVX2 transform by about a fifth
+    if (_simd == SIMD_AVX2) {
+        idct_avx2(b,d);
+        return;
+    }
+    if (_simd) {
+        idct_sse2(b,d);
+        return;
+    }
+#endif
+
     // Transform columns
     for (i = 0; i < 8; ++i) {
         b1 =  b[4*8+i];
@@ -954,65 +1958,107 @@ void MpegDecoder::idct(int* b, int n)
         y5 =  x1 - x2;
         y6 =  x3 - b3;
         y7 = -x0 - ((b4*473 + b6*196 + 128) >> 8);
-        b[0*8+i] =  b7 + y4;
-        b[1*8+i] =  x4 + y3;
-        b[2*8+i] =  y5 - x0;
-        b[3*8+i] =  y6 - y7;
-        b[4*8+i] =  y6 + y7;
-        b[5*8+i] =  x0 + y5;
-        b[6*8+i] =  y3 - x4;
-        b[7*8+i] =  y4 - b7;
+        d[0*8+i] =  b7 + y4;
+        d[1*8+i] =  x4 + y3;
+        d[2*8+i] =  y5 - x0;
+        d[3*8+i] =  y6 - y7;
+        d[4*8+i] =  y6 + y7;
+        d[5*8+i] =  x0 + y5;
+        d[6*8+i] =  y3 - x4;
+        d[7*8+i] =  y4 - b7;
     }
 
     // Transform rows
     for (i = 0; i < 64; i += 8) {
-        b1 =  b[4+i];
-        b3 =  b[2+i] + b[6+i];
-        b4 =  b[5+i] - b[3+i];
-        tmp1 = b[1+i] + b[7+i];
-        tmp2 = b[3+i] + b[5+i];
-        b6 = b[1+i] - b[7+i];
+        b1 =  d[4+i];
+        b3 =  d[2+i] + d[6+i];
+        b4 =  d[5+i] - d[3+i];
+        tmp1 = d[1+i] + d[7+i];
+        tmp2 = d[3+i] + d[5+i];
+        b6 = d[1+i] - d[7+i];
         b7 = tmp1 + tmp2;
-        m0 =  b[0+i];
+        m0 =  d[0+i];
         x4 =  ((b6*473 - b4*196 + 128) >> 8) - b7;
         x0 =  x4 - (((tmp1 - tmp2)*362 + 128) >> 8);
         x1 =  m0 - b1;
-        x2 =  (((b[2+i] - b[6+i])*362 + 128) >> 8) - b3;
+        x2 =  (((d[2+i] - d[6+i])*362 + 128) >> 8) - b3;
         x3 =  m0 + b1;
         y3 =  x1 + x2;
         y4 =  x3 + b3;
         y5 =  x1 - x2;
         y6 =  x3 - b3;
         y7 = -x0 - ((b4*473 + b6*196 + 128) >> 8);
-        b[0+i] =  (b7 + y4 + 128) >> 8;
-        b[1+i] =  (x4 + y3 + 128) >> 8;
-        b[2+i] =  (y5 - x0 + 128) >> 8;
-        b[3+i] =  (y6 - y7 + 128) >> 8;
-        b[4+i] =  (y6 + y7 + 128) >> 8;
-        b[5+i] =  (x0 + y5 + 128) >> 8;
-        b[6+i] =  (y3 - x4 + 128) >> 8;
-        b[7+i] =  (y4 - b7 + 128) >> 8;
+        d[0+i] =  (b7 + y4 + 128) >> 8;
+        d[1+i] =  (x4 + y3 + 128) >> 8;
+        d[2+i] =  (y5 - x0 + 128) >> 8;
+        d[3+i] =  (y6 - y7 + 128) >> 8;
+        d[4+i] =  (y6 + y7 + 128) >> 8;
+        d[5+i] =  (x0 + y5 + 128) >> 8;
+        d[6+i] =  (y3 - x4 + 128) >> 8;
+        d[7+i] =  (y4 - b7 + 128) >> 8;
+    }
+}
+
+// coefficients are left zeroed for the next block, only touched rows are cleared
+inline void clear_rows(int* b, int rows)
+{
+    while (rows) {
+        if (rows & 1)
+            b[0] = b[1] = b[2] = b[3] = b[4] = b[5] = b[6] = b[7] = 0;
+        rows >>= 1;
+        b += 8;
     }
 }
 
+// level to coefficient, m is quantizer_scale*q[zz]
+inline int dequant(int v, int m, bool intra)
+{
+    v *= 2;
+    if (!intra)
+        v += (v < 0 ? -1 : 1);
+    v = (v*m) / 16;
+    if ((v & 1) == 0)
+        v -= v > 0 ? 1 : -1;
+    if (v > 2047)
+        v = 2047;
+    else if (v < -2048)
+        v = -2048;
+    return v;
+}
+
+// Dequantization for the current quantizer_scale, rebuilt when it or the matrices change.
+// Levels of +-1 are most of the AC coefficients, their final scaled values are precomputed.
+void MpegDecoder::make_dequant(bool intra)
+{
+    const uint8_t* q = intra ? intra_q : non_intra_q;
+    int16_t* dq = _dq[intra];
+    int32_t* dq1 = _dq1[intra];
+    for (int zz = 0; zz < 64; zz++) {
+        dq[zz] = quantizer_scale*q[zz];
+        dq1[zz*2] = (dequant(1,dq[zz],intra)*scale_dct_q[zz])*64;
+        dq1[zz*2+1] = (dequant(-1,dq[zz],intra)*scale_dct_q[zz])*64;
+    }
+    _dq_scale[intra] = quantizer_scale;
+}
+
 // 8x8
+// parse coefficients into the batch, returns the count or -1 for a bad block
 int MpegDecoder::block(int block, bool intra)
 {
-    //MEASURE(_block_ticks);
+    MEASURE(_block_ticks);
 
-    const uint8_t* q = non_intra_q;
     int n = 0;
 
-    int b[64];
-    for (int i = 0; i < 64; i += 4)
-        b[i] = b[i+1] = b[i+2] = b[i+3] = 0;
+    int32_t* c = _batch->coeff + _batch->coeffs;
+    int count = 0;
 
     if (intra)  // get DC
     {
         int pb = peek_bits(10);
         int dc_size;
+        int dc;
         if (block < 4) {
-            b[0] = y_dc;
+            dc = y_dc;
 
             // Table B-12 --- Variable length codes for dct_dc_size_luminance
             pb >>= 1;
@@ -1034,7 +2080,7 @@ int MpegDecoder::block(int block, bool intra)
         }
         else {
             // Table B-13 --- Variable length codes for dct_dc_size_chrominance
-            b[0] = (block == 4 ? cr_dc : cb_dc);
+            dc = (block == 4 ? cr_dc : cb_dc);
             if (!(pb & 0x200)) {
                 dc_size = pb >> 8;
                 _b_count -= 2;
@@ -1052,21 +2098,35 @@ int MpegDecoder::block(int block, bool intra)
         {
             int delta = get_bits(dc_size);
             if (delta & (1 << (dc_size - 1)))
-                b[0] += delta;
+                dc += delta;
             else
-                b[0] += ((-1 << dc_size)|(delta+1));
+                dc += (-(1 << dc_size)|(delta+1));
 
             switch (block) {
-                case 4: cr_dc = b[0]; break;
-                case 5: cb_dc = b[0]; break;
-                default: y_dc = b[0]; break;    // update DC prediction
+                case 4: cr_dc = dc; break;
+                case 5: cb_dc = dc; break;
+                default: y_dc = dc; break;    // update DC prediction
             }
         }
-        b[0] <<= 8; // scale
-        q = intra_q;
+        c[count++] = dc*(64 << 8);  // scale, zz 0
         n = 1;
     }
 
+    // coefficients past cap are parsed but not kept
+    int cap = 64;
+    if (block >= 4 && _luma_only)
+        cap = 1;
+    else if (_degrade >= DEGRADE_COEFFS)
+        cap = (block >= 4 && _degrade >= DEGRADE_CHROMA) ? 1 : DEGRADE_COEFF_CAP;
+    if (_reduced)
+        cap = min(cap,_reduced == 8 ? 1 : 3);   // DC, then the first horizontal and vertical frequencies
+
+    if (_dq_scale[intra] != quantizer_scale)
+        make_dequant(intra);
+    const int16_t* dq = _dq[intra];
+    const int32_t* dq1 = _dq1[intra];
+
+    MEASURE_BEGIN();
     for (;;) {       // get AC
         int run,v,zz;
 
@@ -1105,21 +2165,26 @@ int MpegDecoder::block(int block, bool intra)
         n += run;
         if (n >= 64)
             return -1;
+        if (n >= cap) {
+            n++;
+            continue;
+        }
         zz = zig_zag[n++];
 
-        v <<= 1;
-        if (!intra)
-            v += (v < 0 ? -1 : 1);
-        v = (v*quantizer_scale*q[zz]) / 16;
-        if ((v & 1) == 0)
-            v -= v > 0 ? 1 : -1;
-        if (v > 2047)
-            v = 2047;
-        else if (v < -2048)
-            v = -2048;
-
-        b[zz] = v*scale_dct_q[zz];
+        if (v == 1 || v == -1)
+            c[count++] = dq1[zz*2 + (v < 0)] | zz;
+        else
+            c[count++] = (dequant(v,dq[zz],intra)*scale_dct_q[zz])*64 | zz;
     }
+    MEASURE_END(_vlc_ticks);
+    STATS(_mb_stats.coeffs[count]++);
+    return count;
+}
+
+// reconstruct a block from n sparse coefficients
+void MBRender::block(int block, bool intra, const int32_t* c, int n)
+{
+    MEASURE(_block_ticks);
 
     uint8_t* dst = y_addr + (mb_x << 4);
     switch (block) {
@@ -1130,26 +2195,77 @@ int MpegDecoder::block(int block, bool intra)
         case 5: dst = cb_addr + (mb_x << 3); break;
     }
 
-    if (n == 1) {
-        int dc = b[0] >> 8;
+    if (_reduced == 4) {
+        block_quarter(dst,intra,c,n);
+        return;
+    }
+    if (n == 1 && (c[0] & 63) == 0) {
+        int dc = c[0] >> 14;
         if (intra)
             copy_block_dc(dst,dc);
         else
             add_block_dc(dst,dc);
-        return 0;
+        return;
     }
 
-    idct(b,n);
+    int* b = _coeff;    // always zero on entry
+    int rows = 0;       // footprint of coefficients
+    int cols = 0;
+    for (int i = 0; i < n; i++) {
+        int zz = c[i] & 63;
+        b[zz] = c[i] >> 6;
+        rows |= 1 << (zz >> 3);
+        cols |= 1 << (zz & 7);
+    }
+
+    int p[64];
+    idct(b,p,rows,cols);
+    clear_rows(b,rows);
     if (intra)
-        copy_block(dst,b);
+        copy_block(dst,p);
     else
-        add_block(dst,b);
-    return 0;
+        add_block(dst,p);
+}
+
+// 1/4 scale: each 4x4 quarter of the block is flat at its mean. Only frequency 1 reaches the means,
+// cos((2x+1)pi/16)/cos(pi/16) averages 0.6533 over x 0..3, frequency 2 averages to zero.
+void MBRender::block_quarter(uint8_t* dst, bool intra, const int32_t* c, int n)
+{
+    int dc = 0, h = 0, v = 0;
+    for (int i = 0; i < n; i++) {
+        switch (c[i] & 63) {
+            case 0: dc = c[i] >> 6; break;
+            case 1: h = ((c[i] >> 6)*669) >> 10; break;
+            case 8: v = ((c[i] >> 6)*669) >> 10; break;
+        }
+    }
+    int q[4] = {
+        (dc + h + v + 128) >> 8, (dc - h + v + 128) >> 8,
+        (dc + h - v + 128) >> 8, (dc - h - v + 128) >> 8
+    };
+    uint32_t* d32 = (uint32_t*)dst;
+    for (int i = 0; i < 8; i++) {
+        const int* r = q + ((i >> 2) << 1);
+        if (intra) {
+            d32[0] = PIN(r[0])*0x01010101;
+            d32[1] = PIN(r[1])*0x01010101;
+        } else {
+            d32[0] = add_pin(d32[0],r[0]);
+            d32[1] = add_pin(d32[1],r[1]);
+        }
+        d32 += FB_STRIDE >> 2;
+    }
 }
 
 // copy block to destination
-void MpegDecoder::copy_block(uint8_t* dst, int* b)
+void MBRender::copy_block(uint8_t* dst, int* b)
 {
+#ifdef PIXEL_SIMD
+    if (_simd) {
+        copy_block_sse2(dst,b);
+        return;
+    }
+#endif
     int i = 8;
     int stride = FB_STRIDE;
     while (i--) {
@@ -1172,22 +2288,27 @@ void MpegDecoder::copy_block(uint8_t* dst, int* b)
     }
 }
 
-void MpegDecoder::copy_block_dc(uint8_t* dst, int dc)
+void MBRender::copy_block_dc(uint8_t* dst, int dc)
 {
     int i = 8;
     int stride = FB_STRIDE;
-    dc |= dc << 8;
-    dc |= dc << 16;
+    uint32_t v = (uint8_t)dc*0x01010101u;  // damaged streams can put it out of range
     uint32_t* d32 = (uint32_t*)dst;
     while (i--) {
-        d32[0] = dc;
-        d32[1] = dc;
+        d32[0] = v;
+        d32[1] = v;
         d32 += stride >> 2;
     }
 }
 
-void MpegDecoder::add_block(uint8_t* dst, int* b)
+void MBRender::add_block(uint8_t* dst, int* b)
 {
+#ifdef PIXEL_SIMD
+    if (_simd) {
+        add_block_sse2(dst,b);
+        return;
+    }
+#endif
     int i = 8;
     int stride = FB_STRIDE;
     while (i--) {
@@ -1211,110 +2332,260 @@ void MpegDecoder::add_block(uint8_t* dst, int* b)
     }
 }
 
-void MpegDecoder::add_block_dc(uint8_t* dst, int dc)
+void MBRender::add_block_dc(uint8_t* dst, int dc)
 {
     int i = 8;
     int stride = FB_STRIDE;
     while (i--) {
-        uint32_t d;
         uint32_t* d32 = (uint32_t*)dst;
-        uint32_t s = *d32;
-
-        d = PIN(dc + (uint8_t)(s));
-        d |= PIN(dc + (uint8_t)(s >> 8)) << 8;
-        d |= PIN(dc + (uint8_t)(s >> 16)) << 16;
-        d |= PIN(dc + (uint8_t)(s >> 24)) << 24;
-        *d32++ = d;
-        s = *d32;
-        d = PIN(dc + (uint8_t)(s));
-        d |= PIN(dc + (uint8_t)(s >> 8)) << 8;
-        d |= PIN(dc + (uint8_t)(s >> 16)) << 16;
-        d |= PIN(dc + (uint8_t)(s >> 24)) << 24;
-        *d32 = d;
+        d32[0] = add_pin(d32[0],dc);
+        d32[1] = add_pin(d32[1],dc);
         dst += stride;
     }
 }
 
 bool MpegDecoder::slice_done()
 {
-    int m = peek_bits(23);
-    if (!m)
-        return true;        // marker
-    int n = _b_count;
-    while (n--) {           // Any non-zero bits left?
-        if ((_b >> n) & 1)
-            return false;
+    return peek_bits(23) == 0;
+}
+
+// Start codes are byte aligned: 00 00 01 xx. Returns the first possible one at or after p, 0 if none.
+// Uses the same skips as a bytewise search but steps over aligned words without a zero byte.
+static const uint8_t* find_start_code(const uint8_t* p, const uint8_t* end)
+{
+    end -= 3;
+    while (p < end) {
+        if (!((uintptr_t)p & 3)) {
+            while (p + 4 <= end) {
+                uint32_t x = *(const uint32_t*)p;
+                if ((x - 0x01010101) & ~x & 0x80808080)
+                    break;  // has a zero byte
+                p += 4;
+            }
+            if (p >= end)
+                break;
+        }
+        if (p[2] > 1)
+            p += 3;
+        else if (p[1])
+            p += 2;
+        else if (p[0] || p[2] != 1)
+            p++;
+        else
+            return p;
+    }
+    return 0;
+}
+
+// Skip to the next byte aligned start code and return its marker.
+// Skipped bytes and the start code are appended to copy if supplied, until it is over limit.
+int MpegDecoder::next_start_code(std::vector<uint8_t>* copy, size_t limit)
+{
+    if (copy && copy->size() > limit)
+        copy = 0;
+    uint32_t w = 0xFFFFFFFF;
+    _b_count &= ~7;                 // byte align
+    while (_b_count) {              // bytes already in the bit reader
+        int c = (_b >> (_b_count -= 8)) & 0xFF;
+        if (copy)
+            copy->push_back(c);
+        w = (w << 8) | c;
+        if ((w & 0xFFFFFF00) == 0x00000100)
+            return c;
+    }
+
+    for (;;) {
+        if (copy && copy->size() > limit)
+            copy = 0;                   // at most a window over
+        if (_end - _data < FILL_BYTES)
+            refill();
+
+        // search the window once the bytes behind us can't be the start of a code
+        if ((_end - _data) > 3 && (w & 0xFF) && (w & 0xFFFFFF) != 1) {
+            const uint8_t* p = find_start_code(_data,_end);
+            const uint8_t* e = p ? p + 4 : _end - 3;
+            if (copy)
+                copy->insert(copy->end(),_data,e);
+            _data = e;
+            if (p)
+                return p[3];
+            w = 0xFFFFFFFF;
+        }
+
+        // bytewise across the edge of the window
+        int c = *_data++;
+        if (copy)
+            copy->push_back(c);
+        w = (w << 8) | c;
+        if ((w & 0xFFFFFF00) == 0x00000100)
+            return c;
     }
-    return true;            // we should never get here - bad stream if we do
 }
 
+// returns -1 if the slice was skipped, 1 if drawing a B strip stopped below its row
 int MpegDecoder::slice(int s)
 {
     MEASURE(_picture_ticks);
 
-    mb_y = s-2;
-    mb_x = mb_width-1;  // will correct on first increment
-    if (mb_y >= mb_height)
-        return -1;
-
-    reset_predictors();
-    quantizer_scale = get_bits(5);
-    while (get_bit())
-        get_bits(8);
+    int mb = 0;
+    const uint8_t* end = _end;  // saved states can't point into _pad
+    if (_resume && _resume->row && _resume->row <= _only_row) {
+        load_resume(*_resume);  // rows above were drawn from this slice already
+        mb = 1;
+    } else {
+        mb_y = s-2;
+        mb_x = mb_width-1;  // will correct on first increment
+        if (mb_y >= mb_height || mb_y+1 >= FB_SLICES || !mb_width || !picture_coding_type)
+            return -1;  // below the frame, skipped to the next start code
+
+        reset_predictors();
+        b_dir = MB_FORWARD;
+        quantizer_scale = get_bits(5);
+        while (get_bit())
+            get_bits(8);
+    }
 
     // ready for macroblocks
-    for (int mb = 0; !slice_done(); mb++) {
+    for (; !slice_done(); mb++) {
+        if (_resume && mb) {
+            if (mb_y > _only_row) {
+                flush_batch();
+                return 1;   // the rest is below the strip
+            }
+            if (_end == end)
+                save_resume(*_resume);  // the next strip starts at the last one saved
+        }
         int increment = 0;
-        int i = get_vlc(macroblock_address_increment);
+        int i = get_vlc(_mb_addr_inc_vlc);
         while (i == 34)     // mb stuffing
-            i = get_vlc(macroblock_address_increment);
+            i = get_vlc(_mb_addr_inc_vlc);
         while (i == 35) {   // mb escape
             increment += 33;
-            i = get_vlc(macroblock_address_increment);
+            i = get_vlc(_mb_addr_inc_vlc);
         }
         increment += i;
+        if (!i || mb_y + (mb_x + increment)/mb_width >= mb_height) {
+            _bad_slices++;  // every broken slice of a damaged stream, don't print
+            break;          // bad stream, resync at the next start code
+        }
+
+        if (_batch->cmds + 2 > MB_BATCH_CMDS || _batch->coeffs + 6*64 > _batch->coeff_size)
+            flush_batch();
 
         if (mb == 0) {
             inc_mb(increment);
         } else {
-            if (increment > 1)
+            if (increment > 1 && picture_coding_type == B_FRAME) {
+                y_dc = cr_dc = cb_dc = 128;
+                STATS(_mb_stats.skipped += increment-1);
+                while (--increment) {       // skipped B macroblocks repeat the last prediction
+                    inc_mb();
+                    if (_batch->cmds + 2 > MB_BATCH_CMDS)
+                        flush_batch();
+                    inter_cmd(add_cmd(MB_INTER),b_dir);
+                }
+            } else if (increment > 1) {
                 reset_predictors();
-
-            while (increment > 1)
-            {
                 inc_mb();
-                predict_zero();  // copy skipped macroblocks
-                increment--;
+                if (_releasing)
+                    wait_released(mb_y + (mb_x + increment-2)/mb_width);  // row of the last one
+                add_cmd(MB_SKIP)->count = increment-1;  // copy skipped macroblocks
+                STATS(_mb_stats.skipped += increment-1);
+                while (--increment > 1)
+                    inc_mb();
             }
             inc_mb();
         }
 
-        int mb_type = get_vlc(picture_coding_type == I_FRAME ? macroblock_type_I : macroblock_type_P);
+        const VLC& types = picture_coding_type == I_FRAME ? _mb_type_I_vlc : picture_coding_type == P_FRAME ? _mb_type_P_vlc : _mb_type_B_vlc;
+        int mb_type = get_vlc(types);
         int intra = mb_type & 0x01;
 
         if (mb_type & 0x10)
             quantizer_scale = get_bits(5);
 
+        MBCmd* cmd;
         if (intra) // Intra
         {
             forward_motion_h = forward_motion_v = 0;    // reset motion vectors
+            backward_motion_h = backward_motion_v = 0;
+            cmd = add_cmd(MB_INTRA);
         } else {
             y_dc = cr_dc = cb_dc = 128;                 // reset DC prediction
-            motion_vectors(mb_type & 0x08);
-            predict();
+            motion_vectors(mb_type);
+            cmd = add_cmd(MB_INTER);
+            if (picture_coding_type == B_FRAME)
+                b_dir = mb_type & (MB_FORWARD | MB_BACKWARD);
+            inter_cmd(cmd,picture_coding_type == B_FRAME ? b_dir : MB_FORWARD);
         }
 
-        int cbp = mb_type & 0x02 ? get_vlc(coded_block_pattern) : intra ? 63:0;  // coded block pattern
+        int cbp = mb_type & 0x02 ? get_vlc(_cbp_vlc) : intra ? 63:0;  // coded block pattern
+#ifdef MPEG_STATS
+        if (intra)
+            _mb_stats.intra++;
+        else
+            _mb_stats.inter++;
+        if (cbp) {
+            _mb_stats.cbp[cbp & 63]++;
+            _mb_stats.quant[quantizer_scale]++;
+        }
+#endif
         int mask = 0x20;
         for (int i = 0; i < 6; i++) {
-            if (cbp & mask)
-                block(i,intra);
+            if (cbp & mask) {
+                int n = block(i,intra);
+                if (n <= 0 || (i >= 4 && _luma_only))
+                    cbp &= ~mask;   // bad block is dropped, or nothing kept when degraded
+                else {
+                    cmd->n[i] = n;
+                    _batch->coeffs += n;
+                }
+            }
             mask >>= 1;
         }
+        cmd->cbp = cbp;
     }
+    flush_batch();
     return 0;
 }
 
+void MpegDecoder::save_resume(SliceResume& r)
+{
+    r.row = _only_row + 1;
+    r.data = _data;
+    r.b = _b;
+    r.b_count = _b_count;
+    r.mb_x = mb_x;
+    r.mb_y = mb_y;
+    r.dc[0] = y_dc;
+    r.dc[1] = cr_dc;
+    r.dc[2] = cb_dc;
+    r.motion[0] = forward_motion_h;
+    r.motion[1] = forward_motion_v;
+    r.motion[2] = backward_motion_h;
+    r.motion[3] = backward_motion_v;
+    r.b_dir = b_dir;
+    r.quantizer_scale = quantizer_scale;
+}
+
+void MpegDecoder::load_resume(const SliceResume& r)
+{
+    _data = r.data;
+    _b = r.b;
+    _b_count = r.b_count;
+    mb_x = r.mb_x;
+    mb_y = r.mb_y;
+    y_dc = r.dc[0];
+    cr_dc = r.dc[1];
+    cb_dc = r.dc[2];
+    forward_motion_h = r.motion[0];
+    forward_motion_v = r.motion[1];
+    backward_motion_h = r.motion[2];
+    backward_motion_v = r.motion[3];
+    b_dir = r.b_dir;
+    quantizer_scale = r.quantizer_scale;
+}
+
 int MpegDecoder::marker(int m)
 {
     switch (m) {
@@ -1341,6 +2612,34 @@ int MpegDecoder::marker(int m)
 
 void MpegDecoder::pause()
 {
+    drain();
+    if (_bframe_pending)
+        present_b(_last_pts);
+    if (_bframe_pictures || _bframe_dropped)
+        printf("B pictures:%d dropped:%d late strips:%d\n",_bframe_pictures,_bframe_dropped,_jit_late);
+    if (_bframe_skipped)
+        printf("B pictures skipped:%d\n",_bframe_skipped);
+    if (_release_waits)
+        printf("early release rows waited for the beam:%d\n",_release_waits);
+    if (_seek_dropped)
+        printf("pictures decoded but not shown seeking:%d\n",_seek_dropped);
+    if (_bframe_decoder) {
+        _bad_codes += _bframe_decoder->_bad_codes;
+        _bad_slices += _bframe_decoder->_bad_slices;
+        _bframe_decoder->_bad_codes = _bframe_decoder->_bad_slices = 0;
+    }
+    if (_bad_codes)
+        printf("blocks dropped on bad coefficient codes:%d\n",_bad_codes);
+    if (_bad_slices)
+        printf("slices cut short at a bad macroblock:%d\n",_bad_slices);
+    video_shown();
+    _fb[0]->unalias();  // ui draws into the frames
+    _fb[1]->unalias();
+    uint32_t* d = _degrade_pictures;
+    if (d[DEGRADE_COEFFS] || d[DEGRADE_CHROMA] || d[DEGRADE_FULL_PEL])
+        printf("degraded pictures coeffs:%d chroma:%d full pel:%d of %d\n",d[DEGRADE_COEFFS],d[DEGRADE_CHROMA],
+            d[DEGRADE_FULL_PEL],d[0]+d[1]+d[2]+d[3]);
+    _chroma_filled = false;
     printf("MpegDecoder pausing\n");
     clear_events(DECODER_RUN);
     set_events(DECODER_PAUSED);
@@ -1357,11 +2656,588 @@ void MpegDecoder::run()
     for (;;) {
         if (!(get_events() & DECODER_RUN))  // always pause/resume at payload unit start?
             pause();
-        while (peek_bits(24) == 0)
-            get_bit();
-        get_bits(24); // == 1;
-        int m = get_bits(8);
+        int m = next_start_code();
         //printf("%s\n",marker_name(m));
+        if (m >= SLICE_FIRST && m <= SLICE_LAST) {   // both return the marker that followed the slices
+            if (picture_coding_type == B_FRAME)
+                m = keep_b(m);
+            else if (_workers.size())
+                m = decode_slices(m);
+        }
         marker(m);
     }
 }
+
+//========================================================================================
+//========================================================================================
+// Slice parallel decoding
+// Slices reset DC and motion vector prediction so can be decoded independently.
+// The slices of a picture are copied out of the transport stream and handed to workers,
+// each with its own bitstream reader and predictors. Workers write disjoint macroblocks of _current.
+// ESPFlix doesn't use them, the copy (26K for vmedia's largest picture) and a decoder a worker don't fit its heap.
+
+extern "C" void slice_thread(void* arg)
+{
+    ((MpegDecoder*)arg)->slice_worker();
+}
+
+void MpegDecoder::set_workers(int n, int core)
+{
+    if (n < 2 || _workers.size())
+        return;
+    if (_fb[0]->_packed) {
+        printf("slice workers can't draw packed frames\n");
+        return;
+    }
+    _work_q = new Q();
+    _done_q = new Q();
+    for (int i = 0; i < n; i++) {
+        MpegDecoder* w = new MpegDecoder(_fb[0],_fb[1],0);
+        w->_parent = this;
+        _workers.push_back(w);
+        start_thread(slice_thread,w,(core + i) & 1);
+    }
+}
+
+// copy the picture state slices are decoded with
+void MpegDecoder::sync(MpegDecoder* p)
+{
+    _reference = p->_reference;
+    _backward = p->_backward;
+    _current = p->_current;
+    mb_width = p->mb_width;
+    mb_height = p->mb_height;
+    picture_coding_type = p->picture_coding_type;
+    full_pel_forward = p->full_pel_forward;
+    forward_r_size = p->forward_r_size;
+    full_pel_backward = p->full_pel_backward;
+    backward_r_size = p->backward_r_size;
+    _alias = p->_alias;
+    _releasing = p->_releasing;
+    _released = p->_released;
+    _degrade = p->_degrade;
+    _luma_only = p->_luma_only;
+    _reduced = p->_reduced;
+    if (memcmp(intra_q,p->intra_q,64) || memcmp(non_intra_q,p->non_intra_q,64)) {
+        memcpy(intra_q,p->intra_q,64);
+        memcpy(non_intra_q,p->non_intra_q,64);
+        _dq_scale[0] = _dq_scale[1] = -1;
+    }
+}
+
+void MpegDecoder::slice_worker()
+{
+    MpegDecoder* p = _parent;
+    for (;;) {
+        SliceWork* w = (SliceWork*)p->_work_q->pop();
+        sync(p);    // picture state is read only while slices are in flight
+        _b_count = _b = 0;
+        _data = &p->_pic[0] + w->start;
+        _end = &p->_pic[0] + w->end;
+        slice(w->code);
+        p->_done_q->push(w);
+    }
+}
+
+// copy the slices of the picture into _pic, returns the marker that followed them.
+// Past limit the rest are skipped and _pic.size() is over it
+int MpegDecoder::gather_slices(int m, size_t limit)
+{
+    _pic.clear();
+    _work.clear();
+    _work.push_back({m,0,0,FB_SLICES});
+
+    for (;;) {
+        m = next_start_code(&_pic,limit);
+        _work.back().end = (uint32_t)_pic.size() - 4;
+        if (m < SLICE_FIRST || m > SLICE_LAST)
+            break;
+        _work.push_back({m,(uint32_t)_pic.size(),0,FB_SLICES});
+    }
+    return m;
+}
+
+// gather the slices of the picture, decode them in parallel
+int MpegDecoder::decode_slices(int m)
+{
+    m = gather_slices(m);
+
+    // keep the queues shallow, FreeRTOS queues only hold 32
+    int pending = 0;
+    for (size_t i = 0; i < _work.size(); i++) {
+        if (pending == 16) {
+            _done_q->pop();
+            pending--;
+        }
+        _work_q->push(&_work[i]);
+        pending++;
+    }
+    while (pending--)
+        _done_q->pop();
+    for (auto w : _workers) {
+        _release_waits += w->_release_waits;
+        _bad_codes += w->_bad_codes;
+        _bad_slices += w->_bad_slices;
+        w->_release_waits = w->_bad_codes = w->_bad_slices = 0;
+    }
+#ifdef MPEG_STATS
+    for (auto w : _workers) {
+        add_stats(_mb_stats,w->_mb_stats);
+        w->_mb_stats = MBStats();
+    }
+#endif
+    return m;
+}
+
+//========================================================================================
+//========================================================================================
+// B pictures
+// There is no memory for a third frame so B pictures are drawn while they are shown.
+// Their slices are kept and replayed by a second decoder a strip at a time, each strip into a ring
+// slot just ahead of the beam. Strips that can't be drawn in time show the forward reference.
+
+// keep the slices of a B picture until it is due, returns the marker that followed them
+int MpegDecoder::keep_b(int m)
+{
+    size_t most = MPEG_B_SLICE_BYTES + sizeof(Buffer::data) + 16;  // a window and the bit reader over
+    if (_pic.capacity() < most)
+        _pic.reserve(most);
+    m = gather_slices(m,MPEG_B_SLICE_BYTES);
+    if (_pic.size() > MPEG_B_SLICE_BYTES) {
+        _bframe_skipped++;
+        return m;
+    }
+    if (!_bframe_decoder) {
+        _bframe_decoder = new MpegDecoder(_fb[0],_fb[1],0);
+        _bframe_decoder->_parent = this;    // pads the end of each slice with zeros
+    }
+    _bframe_decoder->sync(this);
+    _bframe_decoder->_releasing = false;    // draws into the ring
+    _bframe_pending = true;
+    return m;
+}
+
+// ring size, strips older than this behind the beam are reused
+void MpegDecoder::set_jit_strips(int n)
+{
+    n = min(max(n,2),FB_SLICES);        // one would be drawn while the beam is on it
+    if (n == _jit_strips)
+        return;
+    if (_jit_ready) {                   // reallocated by the next B picture
+        for (int i = 0; i < _jit_strips; i++)
+            free(_jit_ring._slices[i]);
+        _jit_ready = false;
+    }
+    _jit_strips = n;
+    _bframe_shown = false;
+}
+
+// draw macroblock row `row` into ring slot `slot`, every kept slice touching it is parsed.
+// A slice that started above picks up where the strip before stopped, drawn in order each macroblock
+// is parsed once plus the one crossing into the next row.
+void MpegDecoder::draw_b(int row, int slot)
+{
+    MpegDecoder* d = _bframe_decoder;
+    for (int i = 0; i < FB_SLICES; i++)
+        _jit_draw._slices[i] = _jit_scratch;    // rows around it are not drawn
+    _jit_draw._slices[row] = _jit_ring._slices[slot];
+    d->_current = &_jit_draw;
+    d->_only_row = row;
+    for (auto& w : _work) {
+        if (w.code-1 > row || w.last < row)
+            continue;
+        d->_b_count = d->_b = 0;
+        d->_data = &_pic[0] + w.start;
+        d->_end = &_pic[0] + w.end;
+        if (_jit_resume.start != w.start)
+            _jit_resume.row = 0;                // another slice's
+        _jit_resume.start = w.start;
+        d->_resume = &_jit_resume;
+        if (d->slice(w.code) <= 0)
+            w.last = d->mb_y;
+    }
+    d->_resume = 0;
+}
+
+// show the kept B picture until `until`
+void MpegDecoder::present_b(int64_t until)
+{
+    _bframe_pending = false;
+    _seek_pts = -1;
+    if (!_jit_scratch) {
+        _jit_scratch = (uint8_t*)malloc32(FB_STRIDE*FB_SLICE_HEIGHT + 4,"JIT");
+        memset(_jit_scratch,0x80,FB_STRIDE*FB_SLICE_HEIGHT + 4);
+    }
+    uint8_t* fallback[FB_SLICES];           // a packed reference can't be scanned, late strips are grey
+    for (int i = 0; i < FB_SLICES; i++)
+        fallback[i] = _reference->_packed ? _jit_scratch : _reference->_slices[i];
+    if (!_bframe_shown)
+        for (int i = 0; i < FB_SLICES; i++)
+            _jit_view._slices[i] = fallback[i];
+
+    _shown_type = B_FRAME;
+    int first;
+    int fields = video_jit(&_jit_view,_bframe_pts,until,&first);
+    if (!fields) {
+        _bframe_dropped++;
+        return;
+    }
+    if (!_jit_ready) {
+        for (int i = 0; i < FB_SLICES; i++) {
+            _jit_ring._slices[i] = i < _jit_strips ? (uint8_t*)malloc32(FB_STRIDE*FB_SLICE_HEIGHT + 4,"JIT") :
+                _jit_ring._slices[i % _jit_strips];
+            _jit_ring._spare[i] = _jit_view._spare[i] = _jit_draw._spare[i] = 0;
+            _jit_tag[i] = -1;
+        }
+        _jit_ready = true;
+        if (_luma_only)
+            _jit_ring.fill_chroma(0x80);
+    }
+
+    _jit_resume.row = 0;                    // of the last B picture
+    STATS(MBStats& stats = _bframe_decoder->_mb_stats);
+    STATS(stats = MBStats());
+    STATS(stats.type = B_FRAME);
+    _jit_serial++;
+    int n = fields*FB_SLICES;
+    for (int i = 0; i < n; i++) {
+        STATS(if (i == FB_SLICES) _picture_stats = stats);   // later fields redraw
+        int k = i % FB_SLICES;
+        if (k >= _bframe_decoder->mb_height) {
+            _jit_view._slices[k] = fallback[k]; // below the picture, as the frames show it
+            continue;
+        }
+        int a = first + i;                  // on the video_strip clock
+        int s = a % _jit_strips;
+        int tag = _jit_serial*FB_SLICES + k;
+        if (_jit_tag[s] == tag)
+            continue;                       // still there from the last field
+        video_wait_strip(a - _jit_strips);  // slot is still being shown
+        if (video_strip() - a > 0) {
+            _jit_late++;                    // missed it, try again next field
+            continue;
+        }
+        int old = _jit_tag[s];
+        if (old >= 0 && _jit_view._slices[old % FB_SLICES] == _jit_ring._slices[s])
+            _jit_view._slices[old % FB_SLICES] = fallback[old % FB_SLICES];
+        _jit_tag[s] = -1;
+        if (_bframe_decoder->mb_width*16 < FB_WIDTH)    // right of the picture, as the frames show it
+            memcpy(_jit_ring._slices[s],fallback[k],FB_STRIDE*FB_SLICE_HEIGHT);
+        draw_b(k,s);
+        if (video_strip() - a >= 0)
+            _jit_late++;                    // beam got there first
+        _jit_view._slices[k] = _jit_ring._slices[s];
+        _jit_tag[s] = tag;
+    }
+    STATS(if (n <= FB_SLICES) _picture_stats = stats);
+    video_jit_end();
+    _bframe_shown = true;
+    _bframe_pictures++;
+}
+
+//========================================================================================
+//========================================================================================
+// Macroblock pipeline
+// Stage one (slice) parses macroblocks into batches of commands, stage two (MBRender) reconstructs them.
+// Inline a batch holds a macroblock and is rendered as soon as it fills.
+// Pipelined, full batches go to a render thread and stage one only waits at picture boundaries.
+
+MBCmd* MpegDecoder::add_cmd(int type)
+{
+    MBBatch* b = _batch;
+    if (!b->cmds) {
+        b->reference = _reference;
+        b->backward = _backward;
+        b->current = _current;
+        b->mb_width = mb_width;
+        b->alias = _alias;
+        b->luma_only = _luma_only;
+        b->reduced = _reduced;
+        b->only_row = _only_row;
+    }
+    MBCmd* cmd = b->cmd + b->cmds++;
+    cmd->type = type;
+    cmd->cbp = 0;
+    cmd->mb_x = mb_x;
+    cmd->mb_y = mb_y;
+    cmd->count = 1;
+    return cmd;
+}
+
+void MpegDecoder::flush_batch()
+{
+    if (!_batch->cmds)
+        return;
+    if (_render_q) {
+        _render_q->push(_batch);
+        _batch = (MBBatch*)_batch_q->pop();
+    } else
+        _render.render(_batch);
+    _batch->cmds = _batch->coeffs = 0;
+}
+
+#if MPEG_PACKED_FRAMES
+// Pack both frames, returns the bytes freed. The strips are replaced one by one, so not while they are
+// on screen. Workers can't share the strip being drawn.
+int MpegDecoder::set_packed(int bits)
+{
+    if (bits && bits != 2 && bits != 3)
+        return 0;
+    if (bits && _workers.size()) {
+        printf("packed frames can't be drawn by slice workers\n");
+        return 0;
+    }
+    drain();
+    _alias = _alias && !bits;
+    _fb[0]->unalias();              // before either frees strips the other shares
+    _fb[1]->unalias();
+    int freed = _fb[0]->pack(bits) + _fb[1]->pack(bits);
+    return freed;
+}
+#endif
+
+// wait for stage two to finish with the current picture
+void MpegDecoder::drain()
+{
+    flush_batch();
+    if (_render_q) {
+        const void* b[MB_BATCHES];
+        for (int i = 0; i < MB_BATCHES-1; i++)
+            b[i] = _batch_q->pop();
+        for (int i = 0; i < MB_BATCHES-1; i++)
+            _batch_q->push(b[i]);
+    }
+    _render.finish();
+}
+
+extern "C" void render_thread(void* arg)
+{
+    ((MpegDecoder*)arg)->render_worker();
+}
+
+void MpegDecoder::set_pipeline(int core)
+{
+    if (_render_q)
+        return;
+    drain();
+    _render_q = new Q();
+    _batch_q = new Q();
+    for (int i = 0; i < MB_BATCHES; i++) {
+        MBBatch* b = new MBBatch();
+        b->coeff_size = 8*6*64;
+        b->coeff = (int32_t*)malloc32(b->coeff_size*4,"MBBatch");
+        if (i == 0)
+            _batch = b;     // inline batch is abandoned
+        else
+            _batch_q->push(b);
+    }
+    start_thread(render_thread,this,core);
+}
+
+void MpegDecoder::render_worker()
+{
+    for (;;) {
+        MBBatch* b = (MBBatch*)_render_q->pop();
+        _render.render(b);
+        _batch_q->push(b);
+    }
+}
+
+void MBRender::set_mb(int x, int y)
+{
+    mb_x = x;
+    mb_y = y;
+#if MPEG_PACKED_FRAMES
+    if (_packed_current)
+        draw_row(y,x);
+#endif
+    y_addr = _current->get_y(mb_y << 4);
+    cr_addr = y_addr + FB_WIDTH;
+    cb_addr = cr_addr + FB_STRIDE*8;
+}
+
+// copy rows of words between strips
+inline void copy_rows(uint32_t* d, const uint32_t* s, int words, int rows)
+{
+    while (rows--) {
+        for (int i = 0; i < words; i++)
+            d[i] = s[i];
+        d += FB_STRIDE >> 2;
+        s += FB_STRIDE >> 2;
+    }
+}
+
+// Copy a run of skipped macroblocks from the reference, a row of the run at a time.
+// A fully skipped 16 line strip is one copy, or shared with the reference when aliasing.
+void MBRender::skip(int x, int y, int count)
+{
+    MEASURE(_predict_ticks);
+    while (count > 0 && y < FB_SLICES) {
+        int n = min(count,mb_width - x);
+        int m = min(n,(FB_WIDTH >> 4) - x);     // inside the frame
+        const uint32_t* s = (const uint32_t*)_reference->_slices[y];
+#if MPEG_PACKED_FRAMES
+        if (m == (FB_WIDTH >> 4) && _packed_current && _packed_current->_packed == _reference->_packed) {
+            if (_draw_frame == _packed_current && _draw_row == y)
+                _draw_frame = 0;                // nothing of it was drawn
+            copy_rows((uint32_t*)_packed_current->_slices[y],(const uint32_t*)_reference->_slices[y],
+                strip_bytes(_reference->_packed) >> 2,1);
+            count -= n;
+            x = 0;
+            y++;
+            continue;
+        }
+        if (_packed_current && m > 0)
+            draw_row(y,x);
+        if (_reference->_packed)
+            s = (const uint32_t*)ref_strip(_reference,y);
+#endif
+        uint32_t* d = (uint32_t*)_current->_slices[y];
+        if (m == (FB_WIDTH >> 4) && _alias)
+            _current->alias(_reference,y);
+        else if (m == (FB_WIDTH >> 4) && !_luma_only)
+            copy_rows(d,s,(FB_STRIDE*FB_SLICE_HEIGHT) >> 2,1);
+        else if (m > 0) {
+            copy_rows(d + x*4,s + x*4,m*4,16);                          // y
+            if (!_luma_only)
+                copy_rows(d + (FB_WIDTH >> 2) + x*2,s + (FB_WIDTH >> 2) + x*2,m*2,16);  // cr and cb
+        }
+        count -= n;
+        x = 0;
+        y++;
+    }
+}
+
+//========================================================================================
+//========================================================================================
+// Packed frames in stage two
+#if MPEG_PACKED_FRAMES
+// Macroblocks are drawn into a plain strip that is packed when drawing moves to another row.
+// Reference strips are unpacked on demand into a few cached plain ones, decoding mostly moves down the frame.
+
+uint8_t* MBRender::_cache[MPEG_PACKED_CACHE];
+Frame* MBRender::_cache_frame[MPEG_PACKED_CACHE];
+int MBRender::_cache_strip[MPEG_PACKED_CACHE];
+uint32_t MBRender::_cache_used[MPEG_PACKED_CACHE];
+uint32_t MBRender::_cache_clock;
+
+// plain copy of strip s of f
+uint8_t* MBRender::ref_strip(Frame* f, int s)
+{
+    int oldest = 0;
+    for (int i = 0; i < MPEG_PACKED_CACHE; i++) {
+        if (_cache_frame[i] == f && _cache_strip[i] == s) {
+            _cache_used[i] = ++_cache_clock;
+            return _cache[i];
+        }
+        if (_cache_used[i] < _cache_used[oldest])
+            oldest = i;
+    }
+    if (!_cache[oldest])
+        _cache[oldest] = (uint8_t*)malloc32(strip_bytes(0),"MBRender");
+    f->unpack_strip(s,_cache[oldest]);
+    _cache_frame[oldest] = f;
+    _cache_strip[oldest] = s;
+    _cache_used[oldest] = ++_cache_clock;
+    return _cache[oldest];
+}
+
+// f as mocomp sees it from half pel row y, the strips it reads are unpacked
+Frame* MBRender::ref_view(Frame* f, int y)
+{
+    if (!f->_packed)
+        return f;
+    Frame* v = &_ref_view[f == _backward];
+    int luma = ((y >> 1) + 15 + (y & 1)) >> 4;              // strips of the last rows read
+    int chroma = ((y >> 2) + 7 + ((y >> 1) & 1)) >> 3;
+    int bottom = min(max(luma,chroma),FB_SLICES-1);
+    for (int s = y >> 5; s <= bottom; s++)
+        v->_slices[s] = ref_strip(f,s);
+    return v;
+}
+
+// start drawing row y of the packed current frame, unpacked if it was started before
+void MBRender::draw_row(int y, int x)
+{
+    if (_draw_frame == _packed_current && _draw_row == y)
+        return;
+    pack_row();
+    if (!_draw) {
+        _draw = (uint8_t*)malloc32(strip_bytes(0),"MBRender");
+        for (int i = 0; i < FB_SLICES; i++)
+            _draw_view._slices[i] = _draw;
+    }
+    if (x)
+        _packed_current->unpack_strip(y,_draw);
+    _draw_frame = _packed_current;
+    _draw_row = y;
+}
+
+void MBRender::pack_row()
+{
+    if (_draw_frame)
+        _draw_frame->pack_strip(_draw_row,_draw);
+    _draw_frame = 0;
+}
+
+#endif
+
+void MBRender::finish()
+{
+#if MPEG_PACKED_FRAMES
+    pack_row();
+    for (int i = 0; i < MPEG_PACKED_CACHE; i++)
+        _cache_frame[i] = 0;
+#endif
+}
+
+void MBRender::render(MBBatch* b)
+{
+    MEASURE(_render_ticks);
+    _reference = b->reference;
+    _backward = b->backward;
+    _current = b->current;
+    mb_width = b->mb_width;
+    _alias = b->alias;
+    _luma_only = b->luma_only;
+    _reduced = b->reduced;
+#if MPEG_PACKED_FRAMES
+    _packed_current = 0;
+    if (_current->_packed) {
+        _packed_current = _current;
+        _current = &_draw_view;
+    }
+#endif
+
+    const int32_t* c = b->coeff;
+    for (int i = 0; i < b->cmds; i++) {
+        const MBCmd& cmd = b->cmd[i];
+        if (cmd.type == MB_SKIP) {
+            skip(cmd.mb_x,cmd.mb_y,cmd.count);
+            continue;
+        }
+        if (cmd.mb_x >= (FB_WIDTH >> 4) || cmd.mb_y >= FB_SLICES || (b->only_row >= 0 && cmd.mb_y != b->only_row)) {
+            for (int j = 0; j < 6; j++)     // cropped or not wanted
+                if (cmd.cbp & (0x20 >> j))
+                    c += cmd.n[j];
+            continue;
+        }
+        set_mb(cmd.mb_x,cmd.mb_y);
+
+        bool intra = cmd.type == MB_INTRA;
+        if (!intra) {
+            if (cmd.dir & MB_FORWARD)
+                predict(_reference,cmd.motion_h,cmd.motion_v,false);
+            if (cmd.dir & MB_BACKWARD)
+                predict(_backward,cmd.back_h,cmd.back_v,cmd.dir & MB_FORWARD);
+        }
+        int mask = 0x20;
+        for (int j = 0; j < 6; j++) {
+            if (cmd.cbp & mask) {
+                block(j,intra,c,cmd.n[j]);
+                c += cmd.n[j];
+            }
+            mask >>= 1;
+        }
+    }
+}
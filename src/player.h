@@ -12,6 +12,7 @@
 #include "stdlib.h"
 #include "stdio.h"
 #include "stdint.h"
+#include "limits.h"
 #include "sbc_decoder.h"
 #include "streamer.h"
 #include "video.h"
@@ -20,16 +21,264 @@
 //========================================================================================
 //========================================================================================
 // MPEG buffers
-// 1) we only have 2 so no b frames
+// 1) we only have 2 reference frames, B pictures are drawn just in time into a ring of strips
 // 2) They are in 16 pixel high strips
 // 3) The are only accessed in 32 bit wide chunks
-// Frame Buffer is for a 352x192 display
-// 16x(352*3/2) == 8448 byte chunks
+// Frame Buffer is FB_WIDTH x FB_HEIGHT, 352x192 by default
+// 16x(FB_WIDTH*3/2) byte chunks, 8448 at 352
 // YYYYUU
 // YYYYVV
 
 #include "video.h"
 
+#ifdef MPEG_PROFILE
+extern uint32_t _picture_ticks; // cycles spent in slices of the current picture
+extern uint32_t _predict_ticks; // motion compensation and skipped macroblocks
+extern uint32_t _block_ticks;   // coefficient decode + idct + reconstruction
+extern uint32_t _idct_ticks;
+extern uint32_t _vlc_ticks;     // AC coefficient decode
+extern uint32_t _render_ticks;  // stage two, reconstruction from the command stream
+extern uint32_t _release_ticks; // blocked on the beam releasing strips, left out of _picture_ticks
+#endif
+
+// Bit reader cache, 64 bit refilled a word at a time on hosts with unaligned loads.
+// Bytewise into 32 bits on ESP32. Override with -DMPEG_BITS=32/64
+#ifndef MPEG_BITS
+#ifdef ESP_PLATFORM
+#define MPEG_BITS 32
+#else
+#define MPEG_BITS 64
+#endif
+#endif
+
+// Strips of memory B pictures are drawn into just ahead of the beam, FB_SLICES would be a whole
+// third frame. Override with -DMPEG_JIT_STRIPS=n
+#ifndef MPEG_JIT_STRIPS
+#define MPEG_JIT_STRIPS 4
+#endif
+
+// B pictures take a second MpegDecoder (about 7.5K with its batch), MPEG_JIT_STRIPS ring strips and one
+// of scratch (42260 bytes at 4) and MPEG_B_SLICE_BYTES of kept slices, some 66K of heap the first time
+// one is shown. ESPFlix has about 6K left and a failed malloc32 restarts the ESP32, so they are skipped
+// there, and shown as nothing, unless -DMPEG_B_PICTURES=1 and the heap is found elsewhere.
+#ifndef MPEG_B_PICTURES
+#ifdef ESP_PLATFORM
+#define MPEG_B_PICTURES 0
+#else
+#define MPEG_B_PICTURES 1
+#endif
+#endif
+
+// Slices of a B picture are kept up to this many bytes, larger pictures are dropped
+#ifndef MPEG_B_SLICE_BYTES
+#define MPEG_B_SLICE_BYTES 16384
+#endif
+
+// Packed frames, set_packed(2 or 3). At 352x192 the frames take 50688 or 76032 bytes instead of 202848,
+// but MPEG_PACKED_CACHE + 2 plain strips (67616 bytes at 6) and the display's line strip (8452) come on
+// top: a net 76K saved at 2 bits, 51K at 3. On the host decode takes 2-3x as long as plain (vmedia 246%
+// at 2 bits, 209-241% at 3) and luma PSNR against plain is 32.8dB/37.5dB on I pictures, drifting to
+// 28dB/26dB by the end of a GOP. Not built for ESPFlix, see MPEG_PACKED_FRAMES.
+//
+// Plain strips of packed reference frames, a strip above and below for both of a B picture's references
+#ifndef MPEG_PACKED_CACHE
+#define MPEG_PACKED_CACHE 6
+#endif
+
+// Trick play pictures are reconstructed at 1/4 or 1/8 scale, 0 for full. Override with -DMPEG_TRICK_SCALE=n
+#ifndef MPEG_TRICK_SCALE
+#define MPEG_TRICK_SCALE 4
+#endif
+
+#if MPEG_BITS == 64
+typedef uint64_t bits_t;
+#else
+typedef uint32_t bits_t;
+#endif
+
+// Per picture macroblock statistics, build with MPEG_STATS to collect them
+typedef struct {
+    int type;               // picture_coding_type
+    uint32_t intra;         // macroblocks
+    uint32_t inter;
+    uint32_t skipped;
+    uint32_t cbp[64];       // coded macroblocks by coded block pattern, intra is 63
+    uint32_t coeffs[65];    // coded blocks by coefficients kept
+    uint32_t quant[32];     // coded macroblocks by quantizer_scale
+    uint32_t half_pel[4];   // inter macroblocks by luma case: full, h, v, hv
+    int mv_min[2] = {INT_MAX,INT_MAX};  // half pel, h and v, min > max until the first vector
+    int mv_max[2] = {INT_MIN,INT_MIN};
+} MBStats;                  // MBStats() is empty
+
+void add_stats(MBStats& d, const MBStats& s);
+
+// host SIMD kernels, the best the cpu supports is used unless set_simd lowers it
+enum {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+int set_simd(int level);    // returns the level in use
+int simd_level();
+
+// multi-bit vlc lookup built from the bit at a time trees
+typedef struct {
+    uint8_t bits;       // primary table is indexed by the next 'bits'
+    uint8_t sub_bits;   // secondary tables for codes longer than 'bits'
+    const uint16_t* tab;
+} VLC;
+
+// parser state at the macroblock that starts row `row` of a slice, draw_b picks up there for the next strip.
+// Slices don't overlap, one at most runs on into each row.
+typedef struct {
+    int row;            // 0 for none
+    uint32_t start;     // of the slice in _pic
+    const uint8_t* data;
+    bits_t b;
+    int b_count;
+    int mb_x;
+    int mb_y;
+    int dc[3];
+    int motion[4];      // forward h,v backward h,v
+    int b_dir;
+    int quantizer_scale;
+} SliceResume;
+
+// a slice of the current picture, offsets into MpegDecoder::_pic
+typedef struct {
+    int code;
+    uint32_t start;
+    uint32_t end;
+    int last;           // last macroblock row, FB_SLICES until it has been parsed
+} SliceWork;
+
+//========================================================================================
+//========================================================================================
+// Macroblock command stream
+// Stage one parses macroblocks into commands, stage two reconstructs them into the frame.
+// Commands travel in batches, coefficients are sparse (value << 6) | zz in 32 bit only memory
+
+enum {
+    MB_SKIP,        // copy count macroblocks from the reference
+    MB_INTRA,
+    MB_INTER
+};
+
+enum {
+    MB_BACKWARD = 0x04, // MB_INTER predictions, as in macroblock_type
+    MB_FORWARD = 0x08
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t cbp;
+    uint8_t mb_x;
+    uint8_t mb_y;
+    uint16_t count;     // MB_SKIP run
+    uint8_t dir;        // MB_FORWARD and/or MB_BACKWARD
+    int16_t motion_h;   // half pel
+    int16_t motion_v;
+    int16_t back_h;     // B pictures
+    int16_t back_v;
+    uint8_t n[6];       // coefficients of each coded block
+} MBCmd;
+
+// Degraded reconstruction when video is late, each level includes the ones before
+enum {
+    DEGRADE_NONE,
+    DEGRADE_COEFFS,     // only the first DEGRADE_COEFF_CAP coefficients of each block
+    DEGRADE_CHROMA,     // chroma blocks are DC only
+    DEGRADE_FULL_PEL,   // luma motion vectors rounded to full pel
+    DEGRADE_LEVELS
+};
+#define DEGRADE_COEFF_CAP 15    // scan positions kept, the low frequencies
+#define DEGRADE_RECOVER 8       // pictures on time before stepping back up
+
+#define MB_BATCH_CMDS 32
+#define MB_BATCHES 4    // batches in flight when pipelined
+
+typedef struct {
+    Frame* reference;
+    Frame* backward;    // B pictures
+    Frame* current;
+    int mb_width;
+    bool alias;         // share fully skipped strips with the reference
+    bool luma_only;
+    int reduced;        // 1/reduced scale reconstruction, 0 for full
+    int only_row;       // other rows are thrown away, -1 draws all
+    int cmds;
+    int coeffs;
+    int coeff_size;
+    int32_t* coeff;
+    MBCmd cmd[MB_BATCH_CMDS];
+} MBBatch;
+
+// stage two: reconstruction
+class MBRender
+{
+public:
+    void render(MBBatch* b);
+    void finish();              // pack the last row, the frames are about to change roles
+
+protected:
+    Frame* _reference;
+    Frame* _backward;
+    Frame* _current;
+    int mb_width;
+    int mb_x;
+    int mb_y;
+    bool _alias;
+    bool _luma_only;
+    int _reduced;
+
+    uint8_t* y_addr;
+    uint8_t* cr_addr;
+    uint8_t* cb_addr;
+
+    int _coeff[64] = {0};       // dequantized coefficients, zeroed after each block
+
+    // mb
+    void set_mb(int x, int y);
+    void mocomp(uint8_t* dst, Frame* ref, int pos_x, int pos_y, int size, int c, bool avg);
+    void blit(uint8_t* dst, uint8_t* src, int size = 16);
+    void predict_zero(Frame* ref);
+    void predict(Frame* ref, int h, int v, bool avg);
+    void skip(int x, int y, int count);
+
+#if MPEG_PACKED_FRAMES
+    // packed frames, drawn a row at a time into a plain strip
+    Frame* _packed_current = 0; // when _current is _draw_view
+    Frame* _draw_frame = 0;     // frame of _draw_row
+    int _draw_row = -1;
+    uint8_t* _draw = 0;
+    Frame _draw_view;
+    Frame _ref_view[2];         // forward and backward
+
+    // shared, B pictures are drawn while stage two is idle
+    static uint8_t* _cache[MPEG_PACKED_CACHE];
+    static Frame* _cache_frame[MPEG_PACKED_CACHE];
+    static int _cache_strip[MPEG_PACKED_CACHE];
+    static uint32_t _cache_used[MPEG_PACKED_CACHE];
+    static uint32_t _cache_clock;
+
+    uint8_t* ref_strip(Frame* f, int s);
+    Frame* ref_view(Frame* f, int y);
+    void draw_row(int y, int x);
+    void pack_row();
+#else
+    Frame* ref_view(Frame* f, int) { return f; }
+#endif
+
+    // 8x8
+    void idct(const int* b, int* d, int rows, int cols);
+    void block(int block, bool intra, const int32_t* c, int n);
+    void block_quarter(uint8_t* dst, bool intra, const int32_t* c, int n);
+    void copy_block(uint8_t* dst, int* b);
+    void copy_block_dc(uint8_t* dst, int dc);
+    void add_block(uint8_t* dst, int* b);
+    void add_block_dc(uint8_t* dst, int dc);
+};
+
 // integrated transport demux/MPEG decoder
 class MpegDecoder
 {
@@ -38,6 +287,7 @@ public:
     int _fb_index;
     Frame* _reference;  // last frame we decoded, currently being displayed
     Frame* _current;    // frame we are currently drawing into
+    Frame* _backward = 0; // B pictures predict from _reference and this
     int64_t _pts;
     int64_t _last_pts;
     int64_t _audio_pts;
@@ -45,16 +295,80 @@ public:
     int _audio_mark;
 
     // bitstream
-    uint32_t _b = 0;
+    bits_t _b = 0;
     int _b_count = 0;
     const uint8_t* _data;
     const uint8_t* _end;
     int _mark = 0;
     Buffer* _buffer = 0;
+    uint8_t _pad[24];   // eos and worker padding, FILL_BYTES of room for stitching in front
 
     Q _empty_q;
     Q _full_q;
 
+    // slice parallel decoding
+    MpegDecoder* _parent = 0;           // set on workers
+    std::vector<MpegDecoder*> _workers;
+    std::vector<uint8_t> _pic;          // slices of the current picture
+    std::vector<SliceWork> _work;
+    Q* _work_q = 0;
+    Q* _done_q = 0;
+
+    // macroblock pipeline
+    MBRender _render;
+    MBBatch* _batch;                    // being filled by stage one
+    Q* _render_q = 0;                   // full batches to stage two when pipelined
+    Q* _batch_q = 0;                    // and back again
+    bool _alias = false;                // share skipped strips instead of copying
+    bool _luma_only = false;            // chroma is parsed but not reconstructed
+    bool _chroma_filled = false;        // neutral chroma written since the ui last drew
+    int _reduced = 0;                   // 4 or 8 keeps the coefficients of a 1/4 or 1/8 scale picture
+    int _trick_interval = 0;            // pts between trick play pictures, 0 shows them on their own pts
+    int64_t _trick_pts = 0;             // presentation clock of trick play
+    int64_t _seek_pts = -1;             // pictures before it are decoded but not shown
+    uint32_t _seek_dropped = 0;         // pictures not shown while seeking
+    int _current_type = 0;              // of the picture in _current
+
+    // early release, _current is drawn into a strip at a time behind the beam's last scan of it
+    bool _early_release = false;
+    bool _releasing = false;            // strips of _current may still be on screen
+    int _released;                      // video_strip clock of its first strip
+    uint32_t _release_waits = 0;        // rows that caught up with the beam
+    uint32_t _bad_codes = 0;            // coefficient codes that can't exist, reported on pause
+    uint32_t _bad_slices = 0;           // slices cut short at a bad macroblock, reported on pause
+    int _shown_type = 0;                // of the picture handed to push_video
+
+    MBStats _mb_stats = {};             // picture being decoded
+    MBStats _picture_stats = {};        // last complete picture
+
+    // graceful degradation when late
+    int _degrade = DEGRADE_NONE;
+    int _on_time = 0;
+    uint32_t _degrade_pictures[DEGRADE_LEVELS] = {0};  // pictures decoded at each level
+
+    // B pictures are shown before the reference decoded ahead of them. Their slices are kept in _pic
+    // and drawn when the next picture starts, a strip at a time just ahead of the beam.
+    MpegDecoder* _bframe_decoder = 0;   // parses the kept slices
+    bool _bframe_pending = false;
+    bool _bframe_shown = false;         // _jit_view is on screen
+    int64_t _bframe_pts = -1;
+    int _refs = 0;                      // reference pictures since reset, B pictures need two
+    uint32_t _bframe_pictures = 0;
+    uint32_t _bframe_dropped = 0;       // too late to draw ahead of the beam
+    uint32_t _bframe_skipped = 0;       // over MPEG_B_SLICE_BYTES, or MPEG_B_PICTURES is 0
+    int _jit_strips = MPEG_JIT_STRIPS;
+    int _jit_serial = 0;
+    int _jit_tag[FB_SLICES];            // serial*FB_SLICES + strip held by each ring slot, -1 if none
+    Frame _jit_ring;                    // slot k % _jit_strips for strip k
+    Frame _jit_view;                    // scanned by the display, ring slots or the fallback
+    Frame _jit_draw;                    // one strip in the ring, the rest in _jit_scratch
+    uint8_t* _jit_scratch = 0;
+    int _only_row = -1;                 // row draw_b wants, the rest of its slices are parsed only
+    SliceResume* _resume = 0;           // of the slice draw_b is parsing, saved as it goes
+    SliceResume _jit_resume = {};       // the slice running on into the next strip
+    bool _jit_ready = false;            // ring is allocated
+    uint32_t _jit_late = 0;             // strips not ready when the beam reached them
+
     void flush_picture(int mode = 0);
 
     enum {
@@ -75,7 +389,7 @@ public:
         D_FRAME = 4
     };
 
-    MpegDecoder(Frame* fb0, Frame* fb1);
+    MpegDecoder(Frame* fb0, Frame* fb1, int buffers = 4);
 
     void    push_full(Buffer* b);   // from main
     Buffer* pop_empty();
@@ -83,14 +397,34 @@ public:
     void    run();
     int64_t get_pts();
 
+    void    set_workers(int n, int core = 0);   // decode slices in parallel on n threads
+    void    slice_worker();
+    void    set_pipeline(int core = 1);         // reconstruct on another thread
+    void    set_alias(bool a) { _alias = a && !_fb[0]->_packed; }   // frames share fully skipped strips
+#if MPEG_PACKED_FRAMES
+    int     set_packed(int bits);               // pack the frames at 2 or 3 bits a pixel, returns bytes freed, see MPEG_PACKED_CACHE
+#endif
+    void    set_luma_only(bool l) { _luma_only = l; _chroma_filled = false; }
+    void    set_reduced(int scale) { _reduced = (scale == 4 || scale == 8) ? scale : 0; }   // trick play
+    void    set_trick(int interval) { _trick_interval = interval; }    // show pictures interval apart, drop audio
+    void    set_seek(int64_t pts) { _seek_pts = pts; }  // after reset, show nothing before pts
+    void    set_early_release(bool e) { _early_release = e; }  // decode into strips as they are scanned out
+    void    set_jit_strips(int n);              // ring size for B pictures, 2 to FB_SLICES
+    void    degrade(int late);                  // pick the next picture's level from lateness
+    const MBStats& stats() { return _picture_stats; }  // of the picture handed to push_video
+    int     picture_type() { return _shown_type; }      // of the picture handed to push_video
+    void    render_worker();
+
 protected:
     int     demux(int pid, const uint8_t* d, const uint8_t* end, int payload_unit_start);
 
-    uint8_t more();
+    void    more();
+    void    refill();
+    void    pad(const uint8_t* d, int len);
     inline int get_bits(int n);
     inline int peek_bits(int n);
     inline int get_bit();
-    inline int get_vlc(const uint32_t* vlc);
+    inline int get_vlc(const VLC& vlc);
     inline int get_vlc_dct();
 
     // sequence
@@ -109,30 +443,34 @@ protected:
     int pictures;
 
     // picture
-    int picture_coding_type;
-    int full_pel_forward;
-    int forward_r_size;
+    int picture_coding_type = 0;    // no slices before a picture header
+    int full_pel_forward = 0;
+    int forward_r_size = 0;
+    int full_pel_backward = 0;
+    int backward_r_size = 0;
 
     // macroblocks
-    int mb_width;
-    int mb_height;
+    int mb_width = 0;   // no slices before a sequence header
+    int mb_height = 0;
     int mb_size;
     int mb_x;
     int mb_y;
 
-    uint8_t* y_addr;
-    uint8_t* cr_addr;
-    uint8_t* cb_addr;
-
     int y_dc;
     int cr_dc;
     int cb_dc;
 
     int forward_motion_h;
     int forward_motion_v;
+    int backward_motion_h;
+    int backward_motion_v;
+    int b_dir;                      // prediction of the last B macroblock, repeated by skips
 
     uint8_t intra_q[64];
     uint8_t non_intra_q[64];
+    int _dq_scale[2] = {-1,-1};     // quantizer_scale of the tables, [intra]
+    int16_t _dq[2][64];             // quantizer_scale*q[zz]
+    int32_t _dq1[2][64*2];          // final coefficient << 6 for levels 1 and -1
 
     const uint8_t* read_matrix(uint8_t* dst);
     void sequence();
@@ -140,26 +478,34 @@ protected:
     void picture();
 
     void reset_predictors();
+    void sync(MpegDecoder* p);
+    int gather_slices(int m, size_t limit = SIZE_MAX);
+    int decode_slices(int m);
+
+    // B pictures
+    int keep_b(int m);
+    void present_b(int64_t until);
+    void draw_b(int row, int slot);
 
     // mb
-    void mocomp(uint8_t* dst, int pos_x, int pos_y, int size, int c = 0);
     void inc_mb(int n = 1);
-    void blit(uint8_t* dst, uint8_t* src, int size = 16);
-    void predict_zero();
-    void predict();
+    void wait_released(int y);
     int motion_vector(int m, int r_size);
-    void motion_vectors(bool fw);
+    void motion_vectors(int mb_type);
+    void inter_cmd(MBCmd* cmd, int dir);
+    MBCmd* add_cmd(int type);
+    void flush_batch();
+    void drain();
 
     // 8x8
-    void idct(int* b, int n);
     int block(int block, bool intra);
-    void copy_block(uint8_t* dst, int* b);
-    void copy_block_dc(uint8_t* dst, int dc);
-    void add_block(uint8_t* dst, int* b);
-    void add_block_dc(uint8_t* dst, int dc);
+    void make_dequant(bool intra);
 
     bool slice_done();
+    int next_start_code(std::vector<uint8_t>* copy = 0, size_t limit = SIZE_MAX);
     int slice(int s);
+    void save_resume(SliceResume& r);
+    void load_resume(const SliceResume& r);
     int marker(int m);
     void pause();
 };
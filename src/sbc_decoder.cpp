@@ -307,7 +307,7 @@ static int get_samples(SBC_Decode *sbc, const uint8_t *data, int len)
 	bit_allocation(sbc,scale_factor,bits);
     
     int b_count = 0;
-    int b_bits = 0;
+    uint32_t b_bits = 0;
     const uint8_t* b_data = data+4+(sbc->channels*sbc->subbands >> 1);
     
     // load samples for subbands
@@ -373,6 +373,11 @@ int Q::waiting()
     return queue.size();
 }
 
+string to_string(int n)
+{
+    return std::to_string(n);
+}
+
 int stack()
 {
     return -1;
@@ -413,6 +418,7 @@ int Streamer::get(const char* url, uint32_t offset, uint32_t len)
     _mark = 0;
     _offset = offset;
     close();
+    _idle = false;
 
     ip_addr_t host_ip;
 
@@ -513,6 +519,7 @@ void Streamer::get_rom(const uint8_t* rom, int len)
     _content_length = len;
     _mark = _offset = 0;
     _start_ms = ms();
+    _idle = false;
 }
 
 ssize_t Streamer::read(uint8_t* dst, uint32_t len, uint32_t* offset)
@@ -520,6 +527,8 @@ ssize_t Streamer::read(uint8_t* dst, uint32_t len, uint32_t* offset)
     //printf("%dkbits/s\n",_mark*8/(int)(ms()-_start_ms));
     if (offset)
         *offset = _offset + _mark;
+    if (_idle)
+        return 0;
     len = min((uint32_t)(_content_length - _mark),len);
     if (_rom) {
         memcpy(dst,_rom,len);
@@ -561,3 +570,10 @@ void Streamer::close()
     _mark = 0;
 }
 
+// a failed or closed stream reads -1, an idle one 0 as at the end of a range
+void Streamer::idle()
+{
+    close();
+    _idle = true;
+}
+
@@ -36,6 +36,8 @@ enum {
     DECODER_PAUSED = 4,
     AUDIO_READY = 8,
     VIDEO_READY = 16,
+    VIDEO_RELEASE = 32,
+    VIDEO_STRIP = 64,
     DNS_READY = 256
 };
 
@@ -173,12 +175,14 @@ class Streamer
     uint32_t _mark = 0;
     uint32_t _offset;
     uint64_t _start_ms;
+    bool _idle = false;
 public:
     int     get(const char* url, uint32_t offset = 0, uint32_t len = 0);
     int     get_url(const char* url, std::vector<uint8_t>& v, uint32_t offset = 0, uint32_t len = 0);
     void    get_rom(const uint8_t* rom, int len);
     ssize_t read(uint8_t* dst, uint32_t len, uint32_t* offset = 0);
     void    close();
+    void    idle();     // closed with nothing to read yet, read returns 0 until the next get
 };
 
 int printf_nano(const char *fmt, ...);
@@ -682,6 +682,48 @@ uint32_t dither4x4[] = {
     0x02030100,
 };
 
+int _luma_only = 0;
+void video_luma_only(int l)
+{
+    _luma_only = l;
+}
+
+// luma only frames have neutral chroma, one color lookup per line
+void IRAM_ATTR blit_luma(Frame* frame, uint16_t* dst, int line, int x, int width)
+{
+    uint8_t* y_ptr = frame->get_y(line) + x;
+    if (_pal_)
+        dst += 80;
+
+    uint32_t dither = dither4x4[(line&3) + ((_frame_counter & 1) << 2)];
+    uint32_t c = (line & 1) ? CHROMA_ODD(0x80,0x80) : CHROMA_EVEN(0x80,0x80);
+    uint32_t c8 = c << 8;
+    uint32_t p0,p1;
+    uint8_t lum = 0;
+
+    for (int i = 0; i < width; i += 4) {
+        p0 = (*((uint32_t*)y_ptr) + dither) & 0xFCFCFCFC;   // 3 2 1 0
+        p1 = ((p0 >> 1)+(p0 >> 9)) & 0xFCFCFCFC;            // (3>>1)(2+3)(1+2)(0+1)
+        p0 >>= 2;
+        p1 >>= 2;
+
+        lum = ((uint8_t)p0 + lum) >> 1;
+        ((uint32_t*)dst)[0] = ((lum << 24) | ((p0 & 0xFF) << 8)) + c;
+        ((uint32_t*)dst)[1] = ((p1 << 24) | (p0 & 0xFF00)) + c8;
+        ((uint32_t*)dst)[2] = ((p1 << 16) | (p0 >> 8)) + c;
+        ((uint32_t*)dst)[3] = (((p1 << 8) & 0xFF000000) | (p0 >> 16)) + c8;
+        lum = p0 >> 24;
+
+        dst += 8;
+        y_ptr += 4;
+    }
+}
+
+#if MPEG_PACKED_FRAMES
+// packed frames are unpacked a line at a time into this strip
+Frame _line_view;
+#endif
+
 // draw a line of video in NTSC
 // horizontally interpolates luma
 // could vertically interpolate chroma
@@ -691,6 +733,21 @@ void IRAM_ATTR blit(Frame* frame, uint16_t* dst, int line, int x, int width)
 {
     BEGIN_TIMING();
     x &= ~3;
+#if MPEG_PACKED_FRAMES
+    if (frame->_packed) {
+        if (!_line_view._slices[0]) {
+            END_TIMING();
+            return;         // until push_video allocates it
+        }
+        frame->unpack_line(&_line_view,line);
+        frame = &_line_view;
+    }
+#endif
+    if (_luma_only) {
+        blit_luma(frame,dst,line,x,width);
+        END_TIMING();
+        return;
+    }
     uint8_t* y_ptr = frame->get_y(line) + x;
     uint32_t* u_ptr = (uint32_t*)(frame->get_cr(line>>1) + (x >> 1));
     uint32_t* v_ptr = (uint32_t*)(frame->get_cb(line>>1) + (x >> 1));
@@ -703,7 +760,7 @@ void IRAM_ATTR blit(Frame* frame, uint16_t* dst, int line, int x, int width)
     uint8_t lum = 0;    // interpolate luma
 
     if (line & 1) {
-        int n = (line>>1) + (line == 191 ? 0 : 1);
+        int n = (line>>1) + (line == FB_HEIGHT-1 ? 0 : 1);
         uint32_t* u_ptr2 = (uint32_t*)(frame->get_cr(n) + (x >> 1));    // interpolate chroma
         uint32_t* v_ptr2 = (uint32_t*)(frame->get_cb(n) + (x >> 1));
 
@@ -935,12 +992,23 @@ void IRAM_ATTR pal_sync(uint16_t* line, int i)
 
 int8_t _next_frame = -1;
 uint32_t _next_frame_time = 0;
+bool _flip_pending = false;     // push_video returned before the flip
+bool _release_wait = false;
+uint32_t _release_field;        // VIDEO_RELEASE when this field starts
+bool _strip_wait = false;
+int _strip_target;              // VIDEO_STRIP once the beam has passed this strip
 int8_t _current_frame = -1;
 int16_t _hscroll = 0;
 int16_t _vscroll = 0;
 int16_t _animate = 0;
 int16_t _animate_index = 0;
 Frame* _frames = 0;
+Frame* _jit = 0;        // shown when _current_frame is FB_JIT
+
+#define FB_JIT 2
+
+// first line of the frame, letterboxed in the middle of the active lines
+#define ACTIVE_TOP (_pal_ ? 24 + (VIDEO_PAL_LINES - FB_HEIGHT)/2 : 8 + (VIDEO_NTSC_LINES - FB_HEIGHT)/2)
 
 uint32_t _audio_pts = 0;
 uint32_t _video_pts = 0;
@@ -1020,18 +1088,42 @@ void push_audio(const uint8_t* data, int len, int64_t pts, bool pes_complete)
 //========================================================================================
 //========================================================================================
 
-IRAM_ATTR
-void push_video(Frame* f, int front, int64_t pts, int mode)
+// frame counter count when pts is due
+static uint32_t due(int64_t pts)
 {
-    PLOG(PUSH_VIDEO);
-    _frames = f;
     pts /= _pal_ ? 1800 : 1500;     // convert to frame counter counts
     _video_pts = (uint32_t)pts;     // in frame times
     if (_video_frame_counter_origin == 0) {
         _pts_origin = _video_pts;
         _video_frame_counter_origin = _frame_counter;
     }
-    uint32_t d = (_video_pts - _pts_origin) + _video_frame_counter_origin;    // when to display
+    return (_video_pts - _pts_origin) + _video_frame_counter_origin;
+}
+
+// wait until the last frame pushed is showing
+void video_shown()
+{
+    if (!_flip_pending)
+        return;
+    wait_events(VIDEO_READY);
+    clear_events(VIDEO_READY);
+    _flip_pending = false;
+}
+
+IRAM_ATTR
+int push_video(Frame* f, int front, int64_t pts, int mode, int* released)
+{
+    PLOG(PUSH_VIDEO);
+    video_shown();
+    _frames = f;
+    uint32_t d = due(pts);          // when to display
+#if MPEG_PACKED_FRAMES
+    if (f[front]._packed && !_line_view._slices[0]) {
+        uint8_t* s = (uint8_t*)malloc32(FB_STRIDE*FB_SLICE_HEIGHT + 4,"line");
+        for (int i = 0; i < FB_SLICES; i++)
+            _line_view._slices[i] = s;
+    }
+#endif
 
     uint32_t bt = _blit_ticks_min;
     _blit_ticks_min = 0xFFFFFFFF;
@@ -1042,18 +1134,105 @@ void push_video(Frame* f, int front, int64_t pts, int mode)
     }
 
     // Queue the frame, wait for it to be presented.
+    int late = 0;
     if (d < _frame_counter) {
-        int late = _frame_counter - d;
+        late = _frame_counter - d;
         printf("v late:%d\n",late);
         if (late > 2) {
             printf("resetting v timing\n");
             _video_frame_counter_origin = 0;
         }
     }
+    // The frame being replaced is shown until the field before d, or this one if we are late.
+    // Its strips are released as the beam leaves them in that field.
+    if (released && !mode) {
+        uint32_t now = _frame_counter;
+        uint32_t last = (int32_t)(d - 1 - now) > 0 ? d - 1 : now;
+        _next_frame_time = d;
+        _next_frame = front;
+        _flip_pending = true;
+        if (last != now) {
+            clear_events(VIDEO_RELEASE);
+            _release_field = last;
+            _release_wait = true;
+            wait_events(VIDEO_RELEASE);
+        }
+        *released = last*FB_SLICES;
+        return late;
+    }
     _next_frame_time = d;
     _next_frame = front;
     wait_events(VIDEO_READY);
     clear_events(VIDEO_READY);
+    if (released)
+        *released = video_strip() - FB_SLICES;  // all of it
+    return late;        // decoder degrades reconstruction until it catches up
+}
+
+// B pictures are dropped rather than shown late, they need a field of warning to stay ahead of the beam
+int video_jit(Frame* f, int64_t pts, int64_t until, int* first)
+{
+    PLOG(PUSH_VIDEO);
+    video_shown();
+    uint32_t d = due(pts);
+    if ((int32_t)(d - _frame_counter) <= 0)
+        return 0;
+    int fields = 1;
+    if (until > pts)
+        fields = (int)(until/(_pal_ ? 1800 : 1500) - pts/(_pal_ ? 1800 : 1500));
+    if (fields < 1)
+        fields = 1;
+    _jit = f;
+    _next_frame_time = d;
+    _next_frame = FB_JIT;
+    *first = d*FB_SLICES;
+    return fields;
+}
+
+inline int strip_at(uint32_t f, int line)
+{
+    line -= ACTIVE_TOP;
+    if (line < 0)
+        line = 0;
+    if (line > FB_HEIGHT)
+        line = FB_HEIGHT;
+    return f*FB_SLICES + line/FB_SLICE_HEIGHT;
+}
+
+int video_strip()
+{
+    uint32_t f;
+    int line;
+    do {
+        f = _frame_counter;
+        line = _line_counter;
+    } while (f != _frame_counter);
+    return strip_at(f,line);
+}
+
+// the isr checks the target every line
+void video_wait_strip(int s)
+{
+    while (video_strip() - s <= 0) {
+        clear_events(VIDEO_STRIP);
+        _strip_target = s;
+        _strip_wait = true;
+        if (video_strip() - s > 0)
+            break;                  // passed before the isr saw the target
+        wait_events(VIDEO_STRIP);
+    }
+}
+
+void video_blank()
+{
+    video_shown();
+    _current_frame = -1;
+}
+
+void video_jit_end()
+{
+    wait_events(VIDEO_READY);
+    clear_events(VIDEO_READY);
 }
 
 // handle pausing
@@ -1074,7 +1253,8 @@ void video_reset()
 }
 
 // ease in / ease out animator updated 1 per frame
-int16_t DRAM_ATTR _easd[16] = { 0,8,16,24, 48,72,104,136, 176,216,248,280, 304,328,336,344 };
+int16_t DRAM_ATTR _easd[16] = { 0,8,16,24, 48,72,104,136, 176,216,248,280, 304,328,336,344 };    // across 352 pixels
+#define EASD(_i) ((_easd[_i]*FB_WIDTH/VIDEO_MAX_WIDTH) & ~7)
 void IRAM_ATTR animate()
 {
     if (_animate_index == 0) {
@@ -1082,9 +1262,9 @@ void IRAM_ATTR animate()
         return;
     }
     if (_animate_index < 0)
-        _hscroll = -_easd[- ++_animate_index];
+        _hscroll = -EASD(- ++_animate_index);
     else
-        _hscroll = _easd[--_animate_index];
+        _hscroll = EASD(--_animate_index);
 }
 
 //========================================================================================
@@ -1132,8 +1312,12 @@ void IRAM_ATTR video_isr(volatile void* vbuf)
 
     int i = _line_counter++;
     uint16_t* buf = (uint16_t*)vbuf;
-    const int _active_top = 32 + (_pal_ ? 32 : 0);      // center PAL
-    const int _active_bottom = _active_top + 192;       // Fixed height of videos
+    if (_strip_wait && strip_at(_frame_counter,_line_counter) - _strip_target > 0) {
+        _strip_wait = false;
+        set_events_isr(VIDEO_STRIP);    // early release or a B picture's ring slot is free
+    }
+    const int _active_top = ACTIVE_TOP;
+    const int _active_bottom = _active_top + FB_HEIGHT;
     const int _vsync_start = _line_count - (_pal_ ? 8 : 3);
 
     // ntsc
@@ -1142,16 +1326,16 @@ void IRAM_ATTR video_isr(volatile void* vbuf)
         i -= _active_top;
         sync(buf,_hsync);
         burst(buf);
-        uint16_t* dst = buf + _active_start + 16;
+        uint16_t* dst = buf + _active_start + 16 + (VIDEO_MAX_WIDTH - FB_WIDTH);   // centered, 2 samples a pixel
         int f = _current_frame;
         int h = _hscroll;
         if (h < 0) {
-            h += 352;
+            h += FB_WIDTH;
             f ^= 1;
         }
-        blit(&_frames[f],dst,i,h,352-h);
+        blit(f >= FB_JIT ? _jit : &_frames[f],dst,i,h,FB_WIDTH-h);
         if (h)
-            blit(&_frames[f^1],dst + (352-h)*2,i,0,h);
+            blit(&_frames[(f^1) & 1],dst + (FB_WIDTH-h)*2,i,0,h);
     }
     else if (i >= _vsync_start)
     {
@@ -1176,13 +1360,17 @@ void IRAM_ATTR video_isr(volatile void* vbuf)
                 PLOG(VIDEO_READY_P);
             }
         }
+        if (_release_wait && (int32_t)(_frame_counter - _release_field) >= 0) {
+            _release_wait = false;
+            set_events_isr(VIDEO_RELEASE);  // the replaced frame starts its last field
+        }
         blanking(buf);                      // black line
 
         // draw time/progress bar
         int ptop = _active_bottom + 2;
         if (i >= ptop && i<(ptop+VIDEO_COMPOSITE_HEIGHT))
         {
-            uint16_t* dst = buf + _active_start + 16;
+            uint16_t* dst = buf + _active_start + 16 + (VIDEO_MAX_WIDTH - FB_WIDTH);
             composite(dst,i-ptop);
         }
     }
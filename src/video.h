@@ -27,31 +27,86 @@
 #define IR_PIN      0   // TSOP4838 or equivalent on any pin if desired
 
 
+// Frame geometry is fixed at compile time so blit, mocomp and friends fold it into their loops.
+// Other sizes build with -DFB_WIDTH=320 -DFB_HEIGHT=240, streams larger than the frame are cropped.
+#ifndef FB_WIDTH
 #define FB_WIDTH 352
+#endif
+#ifndef FB_HEIGHT
 #define FB_HEIGHT 192
+#endif
 #define FB_STRIDE (FB_WIDTH*3/2) // nice if it is a constant
 #define FB_SLICE_HEIGHT 16
 #define FB_SLICES (FB_HEIGHT/FB_SLICE_HEIGHT)
 
+#define VIDEO_MAX_WIDTH 352     // pixels in the active part of a line, frames are centered in it
+#define VIDEO_NTSC_LINES 240    // active lines, frames are letterboxed in them
+#define VIDEO_PAL_LINES 272
+
+// Reference frames packed at 2 or 3 bits a pixel, MpegDecoder::set_packed. They decode at 2-3x the cost of
+// plain ones and the ui draws straight into the frames, so only bench -k builds them. Override with -DMPEG_PACKED_FRAMES=1
+#ifndef MPEG_PACKED_FRAMES
+#ifdef ESP_PLATFORM
+#define MPEG_PACKED_FRAMES 0
+#else
+#define MPEG_PACKED_FRAMES 1
+#endif
+#endif
+
+static_assert(FB_WIDTH % 16 == 0 && FB_HEIGHT % FB_SLICE_HEIGHT == 0,"frames are whole macroblocks");
+static_assert(FB_WIDTH <= VIDEO_MAX_WIDTH && FB_HEIGHT <= VIDEO_NTSC_LINES,"frame does not fit on screen");
+
 class Frame {
 public:
     uint8_t* _slices[FB_SLICES];
+    uint8_t* _spare[FB_SLICES];     // own strips while _slices aliases the reference
+#if MPEG_PACKED_FRAMES
+    uint8_t _packed = 0;            // bits a pixel of packed strips, 0 for plain
+#else
+    static const uint8_t _packed = 0;
+#endif
     void init();
     uint8_t* get_y(int y);
     uint8_t* get_cr(int y);
     uint8_t* get_cb(int y);
     void erase();
+    void alias(Frame* f, int i);    // share strip i of f
+    void release(Frame* f);         // f is about to be drawn into, give it our own strips back
+    void unalias();                 // copy shared strips back into our own
+    void fill_chroma(uint8_t c);
+
+#if MPEG_PACKED_FRAMES
+    // Packed frames are only read through these, they can't be drawn into directly
+    int pack(int bits);                             // 2 or 3 bits a pixel, 0 unpacks. Returns bytes freed
+    void pack_strip(int i, const uint8_t* src);     // src is a plain strip
+    void unpack_strip(int i, uint8_t* dst);
+    void unpack_line(Frame* view, int line);        // what blit reads of line, into view's strip
+#endif
 };
 
 void video_init(int ntsc);
 void video_reset();
 void video_pause(int p);
-void push_video(Frame* f, int front, int64_t pts, int mode);              // in video.h
+void video_luma_only(int l);   // neutral chroma, skip the color lookups
+int push_video(Frame* f, int front, int64_t pts, int mode, int* released = 0);    // in video.h, returns frames late
+void video_shown();         // wait until the last frame pushed is showing
+void video_blank();         // show nothing until the next frame is pushed, the frames are being drawn into
+
+// Frames drawn while they are shown, a strip at a time ahead of the beam.
+// video_jit schedules f without waiting and returns the fields it is shown for, 0 if it is already late.
+// first is its first strip on the video_strip clock.
+int video_jit(Frame* f, int64_t pts, int64_t until, int* first);
+int video_strip();          // strips scanned so far, fields*FB_SLICES + strips of this field
+void video_wait_strip(int s);   // block until video_strip() has passed s
+void video_jit_end();       // wait until the scheduled frame is showing
+
+// Early release: given released, push_video returns when the frame it replaces starts its last field
+// rather than at the flip. Strip s of that frame can be drawn into once video_strip() - *released > s.
 void push_audio(const uint8_t* data, int len, int64_t pts, bool pes_complete);
 
 #define VIDEO_COMPOSITE_WIDTH 80
 #define VIDEO_COMPOSITE_HEIGHT 16
-#define VIDEO_COMPOSITE_PROGRESS_WIDTH (352-VIDEO_COMPOSITE_WIDTH-32)
+#define VIDEO_COMPOSITE_PROGRESS_WIDTH (FB_WIDTH-VIDEO_COMPOSITE_WIDTH-32)
 extern uint8_t _video_composite[VIDEO_COMPOSITE_HEIGHT*VIDEO_COMPOSITE_WIDTH];
 extern int _video_composite_blend;
 extern int _video_composite_progress;